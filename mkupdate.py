@@ -0,0 +1,51 @@
+#!/usr/bin/env python3
+#
+# mkupdate.py - Makes an image for the sdlocker-tiny SD card updater
+#
+# Usage: mkupdate.py firmware.bin image.upd [max length]
+#
+# The image is a 512 byte header block followed by the firmware, padded
+# to whole blocks. Write it to the card at UPDATE_BLOCK (1024 by default):
+#   dd if=image.upd of=/dev/sdX bs=512 seek=1024
+#
+# Header, little endian: "SDLU", firmware length (16-bit), CRC16 of the
+# firmware (16-bit, as avr-libc's _crc_ccitt_update, starting at 0xffff).
+
+import struct
+import sys
+
+BLOCK = 512
+
+
+def crc_ccitt_update(crc, data):
+    data ^= crc & 0xff
+    data ^= (data << 4) & 0xff
+    return (((data << 8) | (crc >> 8)) ^ (data >> 4) ^ (data << 3)) & 0xffff
+
+
+def main():
+    if len(sys.argv) < 3:
+        sys.exit("usage: mkupdate.py firmware.bin image.upd [max length]")
+
+    with open(sys.argv[1], "rb") as f:
+        firmware = f.read()
+    if len(firmware) % 2:
+        firmware += b"\xff"     # flash is written a word at a time
+    limit = int(sys.argv[3], 0) if len(sys.argv) > 3 else 0x2000
+    if not 0 < len(firmware) <= limit:
+        sys.exit("firmware is %d bytes, must be 1 to %d" % (len(firmware), limit))
+
+    crc = 0xffff
+    for b in firmware:
+        crc = crc_ccitt_update(crc, b)
+
+    header = b"SDLU" + struct.pack("<HH", len(firmware), crc)
+    image = header.ljust(BLOCK, b"\xff") + firmware
+    image = image.ljust(-(-len(image) // BLOCK) * BLOCK, b"\xff")
+    with open(sys.argv[2], "wb") as f:
+        f.write(image)
+    print("%s: %d bytes, CRC16 0x%04x" % (sys.argv[2], len(firmware), crc))
+
+
+if __name__ == "__main__":
+    main()
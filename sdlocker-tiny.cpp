@@ -39,6 +39,7 @@
  *
  *  You might need to change the fuses on the ATTINY85:
  *  lfuse=E2,  hfuse=DF,  efuse=FF or 01
+ *  (efuse=FE when built with UPDATER, which needs SELFPRGEN)
  *
  *  Use the built-in card-detect switch on the SD card socket
  *  to cut the power to the circuit when the card is removed.
@@ -56,15 +57,25 @@
 #include <avr/io.h>
 #include <avr/pgmspace.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/eeprom.h>
 #include <inttypes.h>
 #include <ctype.h>
 #include <util/delay.h>
+#include <util/crc16.h>
+#ifdef UPDATER
+#include <avr/boot.h>
+#endif
 
 #ifndef FALSE
 #define FALSE       0
 #define TRUE        !FALSE
 #endif
 
+#if defined(AUTO_LOCK) && defined(AUTO_UNLOCK)
+#error "AUTO_LOCK and AUTO_UNLOCK are exclusive: each card would be locked and unlocked again at once"
+#endif
+
 
 /*
  * Define commands for the SD card
@@ -74,9 +85,11 @@
 #define SD_SEND_IF_COND     (0x40 + 8)  // CMD8 - send interface (conditional), works for SDHC only
 #define SD_SEND_CSD         (0x40 + 9)  // CMD9 - send CSD block (16 bytes)
 #define SD_SEND_CID         (0x40 + 10) // CMD10 - send CID block (16 bytes)
+#define SD_STOP_TRANS       (0x40 + 12) // CMD12 - stop a multiple block read
 #define SD_SEND_STATUS      (0x40 + 13) // CMD13 - send card status
 #define SD_SET_BLK_LEN      (0x40 + 16) // CMD16 - set length of block in bytes
-#define SD_READ_BLK         (0x40 + 17) // read single block
+#define SD_READ_BLK         (0x40 + 17) // CMD17 - read single block
+#define SD_READ_MULTI_BLK   (0x40 + 18) // CMD18 - read multiple blocks until CMD12
 #define SD_LOCK_UNLOCK      (0x40 + 42) // CMD42 - lock/unlock card
 #define CMD55               (0x40 + 55) // multi-byte preface command
 #define SD_READ_OCR         (0x40 + 58) // read OCR
@@ -90,6 +103,12 @@
 #define LOCK_BIT_MASK       0x10 // mask for the lock bit
 
 
+/*
+ * Define the card capacity status bit mask within byte 0 of the OCR
+ */
+#define OCR_CCS_MASK        0x40 // set for SDHC/SDXC (block addressed) cards
+
+
 /*
  * Define error codes that can be returned by local functions
  */
@@ -97,13 +116,48 @@
 #define SDCARD_NOT_DETECTED 1   // unable to detect SD card
 #define SDCARD_TIMEOUT      2   // last operation timed out
 #define SDCARD_RWFAIL       3   // read/write command failed
+#define SDCARD_LOWVCC       4   // supply too low to write, card untouched
+
+
+/*
+ * Define the data response token sent by the card after a written block
+ */
+#define DATA_RESP_MASK      0x1f    // status bits and the framing bits around them
+#define DATA_RESP_ACCEPTED  0x05    // data accepted, card now busy programming
+
+
+/*
+ * Define the R1 response bits the recovery ladder looks at
+ */
+#define R1_IDLE             0x01    // card is in the idle state, it was reset
+#define R1_CRC_ERROR        0x08    // card saw a corrupted command
+#define R1_MISSED           0xff    // no response (or no data token, or a bad register CRC)
+
+
+/*
+ * Define the recovery ladder. A failed register read climbs it one rung at
+ * a time, starting from the first rung that can fix the failure, and is
+ * tried again after each rung that succeeds. Glitches on the lines are
+ * usually cleared by the first rungs, in well under a millisecond; only a
+ * card that was reset, or that keeps failing, costs a full initialization.
+ */
+#define RUNG_NONE           0   // nothing tried yet
+#define RUNG_RETRY          1   // send the commands again
+#define RUNG_RESYNC         2   // clock the card with CS high until it lets go of the bus
+#define RUNG_RESELECT       3   // pause with CS high, then check the card with CMD13
+#define RUNG_REINIT         4   // initialize the card from CMD0
+#define RUNG_FAULT          5   // give up, the card is faulty
+#define RUNG_NUM            5   // rungs counted, RUNG_RETRY to RUNG_FAULT
+
+#define RESYNC_BYTES        10  // 80 clocks, as at power up
+#define RESELECT_PAUSE      1   // ms with CS high before the check
 
 
 /*
  * Define card types that could be reported by the SD card during probe
  */
 #define SDTYPE_UNKNOWN      0   // card type not determined
-#define SDTYPE_SD           1   // SD v1 (1 MB to 2 GB)
+#define SDTYPE_SD           1   // standard capacity, SD v1 or v2 (up to 2 GB)
 #define SDTYPE_SDHC         2   // SDHC (4 GB to 32 GB)
 
 
@@ -151,6 +205,29 @@
 #define SW_RELEASED     0
 
 
+/*
+ * Define the events passed from interrupts to the main loop.
+ *
+ * The queue is a single-producer/single-consumer ring: only interrupt
+ * handlers push (they never nest, so they act as a single producer) and
+ * only the main loop pops. Each side writes just its own index, so no
+ * critical sections are needed. Indices are free-running bytes, masked
+ * on access, which is why the length must be a power of two.
+ */
+#define EV_NONE         0   // queue is empty
+#define EV_PRESS        1   // button pressed and held for the debounce time
+#define EV_DEADLINE     2   // deadline set with SetDeadline() expired
+#define EV_LOCK         3   // control interface asked to lock the card (EV_LOCK to EV_APPLY
+                            // follow the TWI_CMD_* order)
+#define EV_UNLOCK       4   // control interface asked to unlock the card
+#define EV_SAVE         5   // control interface asked to save the parameters
+#define EV_DEFAULTS     6   // control interface asked to restore the default parameters
+#define EV_APPLY        7   // control interface asked to apply the staged parameters
+
+#define EVENT_QUEUE_LEN     8                       // must be a power of two
+#define EVENT_QUEUE_MASK    (EVENT_QUEUE_LEN - 1)
+
+
 /*
  * Define LED blinking patterns.
  */
@@ -161,609 +238,3926 @@
 #define PATTERN_READING       0xa5000000      // Device trying to read registers from a card. Fast blink 2
 #define PATTERN_FAILED        0x00030003      // Device could not change card lock state. Slow blink 1
 #define PATTERN_WERROR        0x000f000f      // Device could not write registers to a card. Slow blink 2
+#define PATTERN_SLOWCARD      0x003f003f      // Card failed read screening and was not locked. Slow blink 3
+#define PATTERN_DEFAULTS      0xf0f0f000      // Default parameters restored. Three long blinks
+#define PATTERN_LOWVCC        0x00ff00ff      // Supply too low, card not written. Slow blink 4
+#define PATTERN_MISMATCH      0x00330033      // Card does not hold the golden image, not locked. Slow blink 5
+#define PATTERN_QUALIFIED     0xffff0000      // Card passed the endurance qualification. One long blink
 
 
 /*
  * Define the CRC7 polynomial
  */
-#define CRC7_POLY       0x89    // polynomial used for CSD CRCs
-
+#define CRC7_POLY       0x89    // polynomial used for command and CSD CRCs
 
 
 /*
- * Local variables
+ * Define the millisecond clock, Timer1 in CTC mode at CK/64.
  */
-uint32_t    LEDPattern; // Blinking patterns
-uint8_t     sdtype;     // Flag for SD card type
-uint8_t     csd[16];    // Card registers
-uint8_t     cid[16];
-uint8_t     crctable[256];
+#define CLOCK_TOP       ((F_CPU / 64 / 1000) - 1)   // compare value for a 1 ms period
 
 
 /*
- * Local functions
+ * Define the data block timing.
+ * SD cards must start sending a block within 100 ms of a read command.
  */
-static void     Select(void);
-static void     Deselect(void);
-static uint8_t  Xchg(uint8_t c);
-static uint8_t  SDInit(void);
-static uint8_t  ReadCSD(void);
-static uint8_t  WriteCSD(void);
+#define SD_BLOCK_LEN        512     // bytes in a data block
+#define SD_READ_TIMEOUT     100     // max ms to wait for a data token
 
-static uint8_t  SD_send_command(uint8_t command, uint32_t arg);
-static uint8_t  SD_wait_for_data(void);
 
-static void     GenerateCRCTable(void);
-static uint8_t  AddByteToCRC(uint8_t crc, uint8_t b);
+/*
+ * Define the tunable timings. All of them can be overridden at build time,
+ * e.g. make OPTIONS="-DDEBOUNCE_COUNT=3 -DSPI_FAST_DELAY=0"
+ * The ones marked (param) are only defaults for the runtime parameters,
+ * which can also be changed in EEPROM without reflashing.
+ */
+#ifndef DEBOUNCE_COUNT
+#define DEBOUNCE_COUNT      5       // (param) button samples that must agree
+#endif
+#ifndef DEBOUNCE_INTERVAL
+#define DEBOUNCE_INTERVAL   100     // (param) ms between button samples, max 255
+#endif
+#ifndef BLINK_STEP
+#define BLINK_STEP          35      // (param) ms per bit of a LED pattern, max 255
+#endif
+#ifndef SD_INIT_TIMEOUT
+#define SD_INIT_TIMEOUT     1000    // (param) max ms for the card to leave the idle state
+#endif
+#ifndef SD_INIT_POLL
+#define SD_INIT_POLL        0       // (param) ms between ACMD41/CMD1 polls, max 255
+#endif
+#ifndef SD_DATA_WAIT
+#define SD_DATA_WAIT        100     // (param) max bytes to wait for a register data token, max 255
+#endif
+#ifndef READ_RETRIES
+#define READ_RETRIES        5       // attempts to read a card before showing it as faulty
+#endif
+#ifndef READ_RETRY_DELAY
+#define READ_RETRY_DELAY    1000    // ms before trying a faulty card again
+#endif
+#ifndef SD_WRITE_TIMEOUT
+#define SD_WRITE_TIMEOUT    500     // (param) max ms for the card to program the CSD
+#endif
+#ifndef SPI_INIT_DELAY
+#define SPI_INIT_DELAY      4       // SPI half-period stretch during init, keeps SCK under 400 kHz
+#endif
+#ifndef SPI_FAST_DELAY
+#define SPI_FAST_DELAY      0       // SPI half-period stretch once the card is initialized
+#endif
 
-static void     BlinkLED(uint32_t pattern);
-static uint8_t  ButtonIs(uint8_t state);
-static uint8_t  ReadSwitchOnce(void);
-static uint8_t  CardIsLocked(void);
-static void     ReadState(void);
-static void     ShowState(void);
-static void     ToggleState(void);
 
+/*
+ * Define the MISO sampling point. By default MISO is sampled right after
+ * the rising edge of SCK. On long cables the card's answer arrives late,
+ * so it can be sampled later in the high phase instead, still before the
+ * falling edge on which the card shifts out the next bit (SPI mode 0).
+ * Set SPI_SAMPLE_DELAY to a fixed delay for a board, or define
+ * SPI_SAMPLE_CAL to find the best one after each card initialization.
+ */
+#if defined(SPI_SAMPLE_CAL) && !defined(SPI_SAMPLE_DELAY)
+#define SPI_SAMPLE_DELAY    0       // delay until calibrated, in delay loop turns
+#endif
+#define SPI_SAMPLE_MAX      8       // longest delay tried by the calibration
+#ifndef SPI_SAMPLE_MARGIN
+#define SPI_SAMPLE_MARGIN   1       // loop turns added to the shortest delay that reads correctly
+#endif
 
 
-int main(void)
-{
-    uint8_t prevState; // Last known state of the card (locked or unlocked)
+/*
+ * Define the supply check made before each CSD write. The ADC measures the
+ * internal 1.1V bandgap against Vcc, so the reading goes up as Vcc sags:
+ * ADC = 1.1V * 1024 / Vcc. Writes are refused below VCC_MIN.
+ */
+#ifndef VCC_MIN
+#define VCC_MIN             3000    // least supply to write the card at, mV
+#endif
+#define VCC_ADC_MAX         ((1100UL * 1024) / VCC_MIN)     // ADC reading at VCC_MIN
+#define VBG_MUX             0x0c    // ADMUX: Vcc reference, bandgap input
+#define VBG_SETTLE          2       // ms for the bandgap to settle once selected
 
-    // Set up the hardware lines and ports associated with accessing the SD card.
-    SPI_PORT |= (1<<MOSI_BIT) | (1<<SCK_BIT);                   // drive outputs to the SPI port
-    SPI_DDR  |= (1<<CS_BIT) | (1<<MOSI_BIT) | (1<<SCK_BIT);     // make the proper lines outputs
-    SPI_PORT |= (1<<MISO_BIT);                                  // turn on pull-up for input
-    Deselect();                 // Start with SD card disabled
 
-    GenerateCRCTable();         // Needed for some SD commands
+/*
+ * Define the runtime parameter block. It is kept in EEPROM and loaded once
+ * at boot; if its version or checksum don't match, the defaults are used.
+ * Holding the button through the power on LED test restores the defaults.
+ * Bump PARAMS_VERSION whenever the Params layout changes.
+ */
+#define PARAMS_VERSION      1
 
-    LEDSW_AS_LED;               // Set shared LED/switch pin as output (LED)
-    BlinkLED(PATTERN_BOOTING);  // Test LED on power on
-    ReadState();                // Read the card for the first time
+#define PARAM_DATA_WAIT_MIN     8       // least dataWait, bytes: cards take a few to send the token
+#define PARAM_INIT_TIMEOUT_MIN  1000    // least initTimeout, ms: the SD spec allows 1 s
+#define PARAM_WRITE_TIMEOUT_MIN 250     // least writeTimeout, ms: the SD spec allows 250 ms busy
 
-    while (1)
-    {
-        ShowState();                // Display the current state
 
-        if (ButtonIs(SW_PRESSED))   // If the user presses the button...
-        {
-            prevState = CardIsLocked();     // remember the current state
-            ToggleState();                  // then, attempt to change it
-            ReadState();                    // and read again to verify the change
+/*
+ * Define the read screening parameters, used when built with READ_SCREENING.
+ * Before locking, the device reads a span of blocks once with single block
+ * reads (CMD17) to measure access latency, and once with a multiple block
+ * read (CMD18) to measure sustained throughput. Cards exceeding either limit
+ * are reported as slow and left unlocked.
+ */
+#ifndef SCREEN_FIRST_BLOCK
+#define SCREEN_FIRST_BLOCK  0       // first block of the span
+#endif
+#ifndef SCREEN_BLOCKS
+#define SCREEN_BLOCKS       32      // number of blocks in the span
+#endif
+#ifndef SCREEN_MAX_LATENCY
+#define SCREEN_MAX_LATENCY  20      // max ms from CMD17 to data token, worst block
+#endif
+#ifndef SCREEN_MAX_SPAN
+#define SCREEN_MAX_SPAN     1000    // max ms to stream the whole span with CMD18
+#endif
 
-            if (CardIsLocked() == prevState)    // if state did not change as expected
-            {
-                BlinkLED(PATTERN_FAILED);   // blink error a few times
-                BlinkLED(PATTERN_FAILED);
-                BlinkLED(PATTERN_FAILED);
-            }
 
-            ShowState();                    // Display the updated state, and...
+/*
+ * Define the image fingerprint, checked when built with FINGERPRINT. Before
+ * locking, the device streams a span of blocks with a multiple block read
+ * (CMD18) and folds each byte into a CRC32 as it arrives, then compares it
+ * with the digest of the golden image kept in EEPROM. Cards that do not
+ * hold the golden image are left unlocked. The defaults below only fill the
+ * EEPROM image written with make program-eeprom; the device reads the span
+ * and digest from the EEPROM.
+ */
+#ifndef FP_FIRST_BLOCK
+#define FP_FIRST_BLOCK      0           // first block of the span
+#endif
+#ifndef FP_BLOCKS
+#define FP_BLOCKS           2048        // number of blocks in the span (1 MB)
+#endif
+#ifndef FP_DIGEST
+#define FP_DIGEST           0           // CRC32 of the span on the golden image
+#endif
+#define FP_UNSET            0xffffffff  // first block of an erased EEPROM, no golden image
 
-            while (!ButtonIs(SW_RELEASED))  // ...wait until the button is released
-            // note (ButtonIs(SW_PRESSED)) wouldn't do here, we want to debounce the releasing
-            {
-                 _delay_ms(25);
-            }
-        }
-    } // end main while (1) loop
+#define CRC32_INIT          0xffffffff  // CRC32 (IEEE 802.3, as zlib) start and final xor
 
-    return 0; // should never be reached
-}
 
+/*
+ * Define the endurance qualification, run on each inserted card when built
+ * with ENDURANCE. The card is toggled between locked and unlocked
+ * ENDURANCE_CYCLES times through ToggleState(), and each CSD write and
+ * read back verify is timed in clock ticks (8 us) into log2 histograms:
+ * bucket 0 counts 0 ticks, bucket n counts 2^(n-1) to 2^n - 1 ticks, and
+ * the last one everything longer. The results are saved to EEPROM. Cards
+ * with failed cycles, or a worst time over the limits, are rejected.
+ */
+#ifndef ENDURANCE_CYCLES
+#define ENDURANCE_CYCLES        1000    // lock/unlock toggles per card
+#endif
+#ifndef ENDURANCE_MAX_BUSY
+#define ENDURANCE_MAX_BUSY      250     // max ms a card may stay busy after a CSD write
+#endif
+#ifndef ENDURANCE_MAX_VERIFY
+#define ENDURANCE_MAX_VERIFY    20      // max ms to read back and check the CSD
+#endif
+#define HIST_BUCKETS            18      // the last one from 2^16 ticks (524 ms) up
+#define TICKS_PER_MS            (CLOCK_TOP + 1)
 
 
 /*
- * ButtonIs(state)
- * Checks if the button matches the specified state (pressed or not).
- * Handles debouncing. Returns 1 on match, 0 otherwise.
+ * Define the audit log, kept when built with AUDIT_LOG. Each lock or unlock
+ * attempt adds a record to a ring in EEPROM, with a hash of the card's CID,
+ * the action, its result and the boot count (the device powers up on each
+ * card insertion). Records are written by the EEPROM ready interrupt, a
+ * byte at a time, so the lock path never waits for the EEPROM. Records are
+ * numbered, so the oldest one is found after the last in sequence.
  */
-static uint8_t ButtonIs(uint8_t state)
-{
-    uint8_t match = 0;              // Assume state doesn't match
-    uint8_t i;
+#define AUDIT_LEN           40      // records in the ring, fewer than 256
+
+#define AUDIT_LOCK          0x10    // action, high nibble
+#define AUDIT_UNLOCK        0x20
+#define AUDIT_OK            0x00    // result, low nibble
+#define AUDIT_FAILED        0x01    // card did not change
+#define AUDIT_LOWVCC        0x02    // not written, supply too low
+#define AUDIT_SLOW          0x03    // not locked, failed read screening
+#define AUDIT_MISMATCH      0x04    // not locked, failed the image fingerprint
+
+#ifdef AUDIT_LOG
+#define AUDIT_BEGIN(a)      AuditBegin(a)
+#define AUDIT_END(r)        AuditEnd(r)
+#else
+#define AUDIT_BEGIN(a)
+#define AUDIT_END(r)
+#endif
 
-    if (ReadSwitchOnce() == state)  // if switch state seems to match
-    {
-        match = 1;
-        for (i=0; i<5; i++)         // debounce check every 100ms, 5 times
-        {
-            _delay_ms(100);
-            if (ReadSwitchOnce() != state)  // if state doesn't match now
-            {
-                match = 0;          // terminate debounce check
-                break;
-            }
-        }
-    }
-    return match;
-}
 
+/*
+ * Define the card policy lookup, built in with CARD_POLICY. Cards carrying
+ * a file named POLICY_NAME (any extension) in the root directory of their
+ * first partition are locked as soon as they are inserted. The lookup
+ * streams the MBR, boot sector and root directory with CMD17 and picks the
+ * few fields it needs out of the data as it arrives, so no sector buffer is
+ * needed. FAT12/16 root directories are scanned whole; on FAT32 and exFAT
+ * only the first cluster of the root directory is.
+ */
+#ifndef POLICY_NAME
+#define POLICY_NAME         "LOCKME"    // marker file, uppercase, 8 chars at most
+#endif
+#define POLICY_NAME_LEN     (sizeof(POLICY_NAME) - 1)
+
+#define BOOT_SIGNATURE      0xaa55  // last two bytes of the MBR and boot sectors
+#define FAT_ATTR_VOLUME     0x08    // FAT entry is the volume label (or a long name)
+#define FAT_ATTR_DIR        0x10    // FAT entry is a directory
+#define EXFAT_FILE          0x85    // exFAT file entry, followed by the two below
+#define EXFAT_STREAM        0xc0    // exFAT stream extension entry, holds the name length
+#define EXFAT_NAME          0xc1    // exFAT file name entry, up to 15 UTF-16 chars
+#define EXFAT_ATTR_DIR      0x10    // exFAT file entry is a directory
+#define DIR_ENTRY_LEN       32      // bytes in a FAT or exFAT directory entry
+#define POLICY_MAX_BLOCKS   64      // most root directory blocks scanned
 
 
 /*
- * ReadSwitchOnce()
- * Checks if the switch is closed. NO debouncing.
- * Also handles I/O switching for the shared LEDSW pin, so that line
- * is always set as an output (LED) outside of this function.
+ * Define the SD card updater, built in with UPDATER. Holding the button
+ * through the power on LED test looks for a firmware image on the card
+ * (made with "make update") and, if it is valid, flashes and starts it.
+ * Without one, the button hold restores the default parameters as usual.
+ *
+ * The updater has its own sections at the top of flash, placed by the
+ * Makefile, and never calls into the application, which it overwrites.
+ * Images carry only the application, so the updater stays the one first
+ * flashed with the programmer: the application reaches it through fixed
+ * jumps at UPDATER_START (resume, then update), never by its link address.
+ * While it writes, page 0 holds a reset vector pointing at it, so an
+ * interrupted update resumes on the next power up; the real page 0 is
+ * written last. Only a power loss while page 0 itself is erased and
+ * rewritten, at the start or at the end, leaves nothing to reset into.
+ * Needs SELFPRGEN programmed (efuse=FE).
+ *
+ * The image is kept past the MBR, in blocks that partitioning tools leave
+ * unused: a header block at UPDATE_BLOCK (magic, then length and CRC16
+ * of the image, little endian) followed by the image itself.
  */
-static uint8_t ReadSwitchOnce(void)
-{
-    uint8_t switchState;
+#ifndef UPDATE_BLOCK
+#define UPDATE_BLOCK        1024    // block holding the image header
+#endif
+#ifndef UPDATER_START
+#define UPDATER_START       0x1c00  // flash address of the updater entry, set by the Makefile
+#endif
+#define UPDATE_MAGIC        0x554c4453  // "SDLU" read little endian
+#define UPDATE_POLLS        1000    // ACMD41 polls, 1 ms apart, before giving up on the card
+#define UPDATE_TOKEN_WAIT   1000    // bytes to wait for a data token
+#define UPDATE_NO_CARD      0xff    // BootInit() failed
+#define UPDATER_RESUME      (UPDATER_START + 0)     // jump to BootEntry's resume path, from page 0
+#define UPDATER_UPDATE      (UPDATER_START + 2)     // jump to BootUpdate(), called by the application
 
-    TURN_LED_OFF;   // Set line high to turn off LED
-    LEDSW_AS_SW;    // Set shared pin as input (switch)
-    SW_PULLUP;      // Enable internal pull-up by setting line high again
+#define RJMP(from, to)      (0xc000 | ((((to) - (from)) / 2 - 1) & 0x0fff))  // rjmp opcode, byte addresses
+#define BOOTLOADER          __attribute__((section(".bootloader"), noinline))
 
-    switchState = SW_GET_STATE;
 
-    LEDSW_AS_LED;     // Set shared pin as output (LED) again
-    if (CardIsLocked())    // and if needed,
-    {
-        TURN_LED_ON;  // turn LED back on before returning
-    }
+/*
+ * Define the instrumentation level, set with "make INSTRUMENT=n":
+ *   0  nothing, every hook compiles away (production builds)
+ *   1  worst time per phase, event counters and stack watermark
+ *   2  as 1, plus a transcript of the last SD bus transactions
+ * Results are kept in RAM, to be read with a debugger or from a simulator
+ * memory dump. Hooks are the INSTR_*() macros, always alone on their line,
+ * so "make zerocost" can check that level 0 builds the very same image as
+ * the source with every hook line deleted.
+ */
+#ifndef INSTRUMENT
+#define INSTRUMENT      0
+#endif
 
-    return switchState;
-}
+#define PHASE_BOOT      0   // power on to first valid card state
+#define PHASE_INIT      1   // SDInit()
+#define PHASE_REGS      2   // ReadRegisters()
+#define PHASE_WRITE     3   // WriteCSD()
+#define PHASE_TOGGLE    4   // button press confirmed to new state shown
+#define PHASE_WAKE      5   // pin change wake to button press confirmed
+#define PHASE_POLICY    6   // CardWantsLock()
+#define PHASE_COUNT     7
+
+#define CNT_XCHG        0   // bytes exchanged over SPI
+#define CNT_COMMANDS    1   // commands sent to the card
+#define CNT_BUSY        2   // busy polls after CMD27
+#define CNT_EVENTS      3   // events taken by the main loop
+#define CNT_NUM         4
+
+#define TRACE_LEN       16  // SD transactions kept, must be a power of 2
+#define TRACE_MASK      (TRACE_LEN - 1)
+
+#define STACK_PAINT     0xc5    // fill for the unused RAM at reset
+
+#if INSTRUMENT >= 1
+#define INSTR_PHASE_BEGIN(p)    PhaseBegin(p)
+#define INSTR_PHASE_END(p)      PhaseEnd(p)
+#define INSTR_COUNT(c)          (instrCount[c]++)
+#define INSTR_STACK()           CheckStack()
+#else
+#define INSTR_PHASE_BEGIN(p)
+#define INSTR_PHASE_END(p)
+#define INSTR_COUNT(c)
+#define INSTR_STACK()
+#endif
 
+#if INSTRUMENT >= 2
+#define INSTR_SELECT()          TraceSelect()
+#define INSTR_DESELECT()        TraceDeselect()
+#define INSTR_TRACE_BYTE()      TraceByte()
+#define INSTR_TRACE(cmd, r)     TraceCommand(cmd, r)
+#else
+#define INSTR_SELECT()
+#define INSTR_DESELECT()
+#define INSTR_TRACE_BYTE()
+#define INSTR_TRACE(cmd, r)
+#endif
 
 
 /*
- * BlinkLED(pattern)
- * Makes the LED blink in the specified pattern.
+ * Define read screening results
  */
-void BlinkLED(uint32_t pattern)
-{
-    uint8_t i;
-    for (i=0; i<32; i++)
-    {
-        if (pattern & 0x80000000)
-        {
-            TURN_LED_ON;
-        }
-        else
-        {
-            TURN_LED_OFF;
-        }
-        _delay_ms(35);
-        pattern = pattern << 1;
-        if (pattern == 0)
-        {
-            break; // leave blink loop if no more ON bits
-        }
-    }
-}
+#define SCREEN_PASS     0   // card is fast enough
+#define SCREEN_SLOW     1   // card exceeded a latency or throughput limit
+#define SCREEN_ERROR    2   // card failed a read
+
 
+/*
+ * Define image fingerprint results
+ */
+#define FP_MATCH        0   // card holds the golden image
+#define FP_MISMATCH     1   // digest differs, or no golden image configured
+#define FP_ERROR        2   // card failed a read
 
 
 /*
- * ReadState()
- * Read the locked/unlocked state from the card.
- * This function won't return until the state has been read.
+ * Define the two-wire (I2C) slave control interface, used when built with
+ * TWI_SLAVE. The USI shares SDA with MOSI (PB0) and SCL with SCK (PB2), so
+ * the interface is only attached while the card is idle (CS deasserted).
+ * While the device is busy with the card it does not acknowledge its
+ * address, so the master should poll until it does.
+ *
+ * The master writes a register number, then either writes data to it or
+ * reads from it; the register number auto-increments after each byte.
  */
-static void ReadState(void)
-{
-    uint8_t r;
+#ifndef TWI_ADDRESS
+#define TWI_ADDRESS         0x2c    // 7-bit slave address
+#endif
+#define TWI_STOP_TIMEOUT    10      // max ms to let a transfer finish before taking the bus
+
+#define TWI_REG_STATUS      0x00    // read: TWI_STATUS_* bits
+#define TWI_REG_COMMAND     0x01    // write: TWI_CMD_*, always reads back 0
+#define TWI_REG_CID         0x02    // read: 16 bytes of CID
+#define TWI_REG_CSD         0x12    // read: 16 bytes of CSD
+#define TWI_REG_COUNTERS    0x22    // read: COUNT_NUM 16-bit counters, little endian
+#define TWI_REG_PARAMS      0x28    // read/write: staged runtime parameters (Params), from debounceCount
+#define TWI_PARAMS_LEN      (sizeof(Params) - 2)    // version and check are internal, 9 bytes
+#define TWI_REG_AUDIT       0x31    // read: audit log, oldest record first, one byte per read
+                                    // write: rewind to the oldest record
+#define TWI_REG_TRACE       0x32    // read: bus transcript, oldest entry first, one byte per read
+                                    // write: clear the transcript
+#define TWI_REG_FINGERPRINT 0x33    // read: last fingerprint (Fingerprint), CRC32 then span time
+#define TWI_REG_RECOVERIES  0x39    // read: RUNG_NUM 16-bit recovery ladder counters, little endian
+#define TWI_REG_ENDURANCE   0x43    // read: last endurance qualification (Endurance), little endian
+
+#define TWI_STATUS_READY    0x01    // card registers are valid
+#define TWI_STATUS_LOCKED   0x02    // card is locked
+#define TWI_STATUS_PENDING  0x04    // a command is waiting to be run
+#define TWI_STATUS_FAILED   0x08    // the last command did not change the card, or its parameters were out of range
+
+#define TWI_CMD_NONE        0x00
+#define TWI_CMD_LOCK        0x01    // lock the card
+#define TWI_CMD_UNLOCK      0x02    // unlock the card
+#define TWI_CMD_SAVE        0x03    // save the runtime parameters to EEPROM
+#define TWI_CMD_DEFAULTS    0x04    // restore and save the default runtime parameters
+#define TWI_CMD_APPLY       0x05    // apply the staged runtime parameters
+
+#define COUNT_LOCKS         0       // cards locked
+#define COUNT_UNLOCKS       1       // cards unlocked
+#define COUNT_FAILURES      2       // lock/unlock attempts that failed
+#define COUNT_NUM           3
 
-    // In all cases, try first to initialize the card.
-    r = SDInit();
-    while (r != SDCARD_OK)
-    {
-        BlinkLED(PATTERN_LOADING);
-        r = SDInit(); // keep trying
-    }
+/*
+ * Define the USI two-wire slave states and transitions, as in Atmel AVR312
+ */
+#define TWI_CHECK_ADDRESS   0
+#define TWI_SEND_DATA       1
+#define TWI_REQUEST_ACK     2
+#define TWI_CHECK_ACK       3
+#define TWI_REQUEST_DATA    4
+#define TWI_GET_DATA        5
 
-    // Card initialized, now read the CSD
-    r = ReadCSD();
-    while (r != SDCARD_OK)
-    {
-        BlinkLED(PATTERN_READING);
-        r = ReadCSD(); // keep trying
-    }
-}
+#define SDA_BIT             MOSI_BIT
+#define SCL_BIT             SCK_BIT
+
+#define USI_WAIT_FOR_START  { USICR = (1<<USISIE) | (1<<USIWM1) | (1<<USICS1); \
+                              USISR = (1<<USIOIF) | (1<<USIPF); }
+#define USI_SEND_ACK        { USIDR = 0; SPI_DDR |= (1<<SDA_BIT); \
+                              USISR = (1<<USIOIF) | (1<<USIPF) | (0x0e<<USICNT0); }
+#define USI_READ_ACK        { SPI_DDR &= ~(1<<SDA_BIT); USIDR = 0; \
+                              USISR = (1<<USIOIF) | (1<<USIPF) | (0x0e<<USICNT0); }
+#define USI_SEND_DATA       { SPI_DDR |= (1<<SDA_BIT); \
+                              USISR = (1<<USIOIF) | (1<<USIPF); }
+#define USI_READ_DATA       { SPI_DDR &= ~(1<<SDA_BIT); \
+                              USISR = (1<<USIOIF) | (1<<USIPF); }
 
 
 
 /*
- * ShowState()
- * Shows the locked/unlocked state of the card, using the LED
- * LED steadily on  = card is locked (write-protected)
- * LED off          = card is unlocked
+ * Card registers, collected in one pass by ReadRegisters()
  */
-static void ShowState(void)
+typedef struct
 {
-    if (CardIsLocked())
-    {
-        BlinkLED(PATTERN_LOCKED);
-    }
-    else
-    {
-        BlinkLED(PATTERN_UNLOCKED);
-    }
-}
+    uint8_t ocr[4];     // operating conditions register (CMD58)
+    uint8_t cid[16];    // card identification register (CMD10)
+    uint8_t csd[16];    // card specific data register (CMD9)
+    uint8_t status[2];  // card status, R2 response (CMD13)
+} CardRegs;
 
 
 
 /*
- * ToggleState:
- * Toggle the locked/unlocked state on the card.
+ * Runtime parameters, see PARAMS_VERSION
  */
-static void ToggleState(void)
+typedef struct
 {
-    uint8_t r;
-
-    if (CardIsLocked())     // get ready to unlock it
-    {
-        csd[14] &= ~LOCK_BIT_MASK;   // clear bit 12 of CSD (temp lock)
-    }
-    else                    // otherwise, get ready to lock it
-    {
-      csd[14] |= LOCK_BIT_MASK;      // set bit 12 of CSD (temp lock)
-    }
+    uint8_t  version;           // PARAMS_VERSION
+    uint8_t  debounceCount;     // DEBOUNCE_COUNT
+    uint8_t  debounceInterval;  // DEBOUNCE_INTERVAL
+    uint8_t  blinkStep;         // BLINK_STEP
+    uint8_t  initPoll;          // SD_INIT_POLL
+    uint8_t  dataWait;          // SD_DATA_WAIT
+    uint16_t initTimeout;       // SD_INIT_TIMEOUT
+    uint16_t writeTimeout;      // SD_WRITE_TIMEOUT
+    uint8_t  check;             // makes the sum of all bytes 0xff
+} Params;
+
+#ifdef TWI_SLAVE
+static_assert(TWI_REG_PARAMS + TWI_PARAMS_LEN <= TWI_REG_AUDIT, "TWI registers overlap the parameters");
+#endif
 
-    r = WriteCSD(); // Attempt to write the new state to the card.
-    if (r != SDCARD_OK) // If state not properly written...
-    {
-        BlinkLED(PATTERN_WERROR);   // ...notify this error
-        BlinkLED(PATTERN_WERROR);
-        BlinkLED(PATTERN_WERROR);
-    }
-}
+#define PARAMS_DEFAULTS     { PARAMS_VERSION, DEBOUNCE_COUNT, DEBOUNCE_INTERVAL, BLINK_STEP, \
+                              SD_INIT_POLL, SD_DATA_WAIT, SD_INIT_TIMEOUT, SD_WRITE_TIMEOUT, 0 }
 
 
 
 /*
- * CardIsLocked()
- * Returns 1 if the card is locked, 0 otherwise
+ * Card quirks, matched on the CID by FindQuirk(). Fields left at 0 (or
+ * empty) match any card, or keep the runtime parameter.
  */
-static uint8_t CardIsLocked(void)
+typedef struct
 {
-    return (csd[14] & LOCK_BIT_MASK); // check lock bit from CSD
-}
+    uint8_t  mid;           // manufacturer ID, CID byte 0
+    char     id[8];         // OEM ID and product name, CID bytes 1 to 7
+    uint8_t  initPoll;      // ms between ACMD41/CMD1 polls
+    uint16_t initTimeout;   // max ms for the card to leave the idle state
+    uint8_t  spiDelay;      // least SPI half-period stretch, caps the SPI rate
+    uint16_t writeTimeout;  // max ms for the card to program the CSD
+} Quirk;
 
+#define QUIRK_OR_PARAM(f)   (quirk.f ? quirk.f : params.f)
 
+/*
+ * An audit log record, as kept in EEPROM. Never written records read 0xff.
+ */
+typedef struct
+{
+    uint8_t     seq;            // record number, one more than the previous
+    uint8_t     event;          // AUDIT_* action and result
+    uint16_t    boot;           // boot count when recorded
+    uint16_t    cidHash;        // CRC16 (CCITT) of the card's CID
+} AuditRecord;
 
 /*
- * Select()
- * Selects (CS enable) the SD card.
+ * Fields picked out of a card block by ReadFields(), in increasing offset
+ * order, and where they end up. AVR structs have no padding, so the
+ * fields land in the members in order.
  */
-static void Select(void)
+typedef struct
 {
-    SPI_PORT &= ~(1<<CS_BIT);
-}
+    uint16_t    offset;         // first byte of the field in the block
+    uint8_t     len;            // bytes in the field
+} Field;
 
+typedef struct
+{
+    uint32_t    start;          // first block of partition 1
+    uint16_t    signature;      // BOOT_SIGNATURE
+} MbrFields;
 
+typedef struct
+{
+    char        name[5];        // "EXFAT" on exFAT, OEM name otherwise
+    uint16_t    bytesPerSector; // FAT only, from here to rootCluster
+    uint8_t     sectorsPerCluster;
+    uint16_t    reservedSectors;
+    uint8_t     fats;
+    uint16_t    rootEntries;    // 0 on FAT32
+    uint16_t    fatSize16;      // 0 on FAT32
+    uint32_t    fatSize32;
+    uint32_t    rootCluster;
+    uint32_t    heapOffset;     // exFAT only, from here to sectorsPerClusterShift
+    uint32_t    rootClusterEx;
+    uint8_t     bytesPerSectorShift;
+    uint8_t     sectorsPerClusterShift;
+    uint16_t    signature;      // BOOT_SIGNATURE
+} BootFields;
 
 /*
- * Deselect:
- * Deselects (CS disable) the SD card.
+ * The golden image the fingerprint is checked against, kept in EEPROM.
  */
-static void Deselect(void)
+typedef struct
 {
-    SPI_PORT |= (1<<CS_BIT);
-}
-
+    uint32_t    first;          // first block of the span, FP_UNSET if none
+    uint16_t    blocks;         // number of blocks in the span
+    uint32_t    digest;         // CRC32 of the span
+} Golden;
 
+/*
+ * The outcome of the last fingerprint, for the master.
+ */
+typedef struct
+{
+    uint32_t    digest;         // CRC32 of the span on the card
+    uint16_t    span;           // ms taken to stream and hash it
+} Fingerprint;
 
 /*
- * Xchg(c)
- * Exchange a byte of data with the SD card via host's SPI bus.
+ * A point in time for the endurance timings, finer than Millis().
  */
-static uint8_t Xchg(uint8_t c)
+typedef struct
 {
-    uint8_t bit = 0;
+    uint16_t    ms;             // clockTicks
+    uint8_t     tick;           // TCNT1, 8 us each
+} Stamp;
 
-    // I tried to get the SPI to work following Atmel's USI specs, and failed
-    // However, bit-banging works, so I'm going with that.
-    for (bit=0; bit<8; bit++)   // Loop through 8 bits
-    {
-        if(c & 0x80) SPI_PORT |= (1<<MOSI_BIT); // If bit(7) of "c" is high
-        else SPI_PORT &= ~(1<<MOSI_BIT);        // if bit(7) of "c" is low
-        SPI_PORT |= (1<<SCK_BIT);               // Serial Clock Rising Edge
-        c <<= 1;                                // Shift "c" to the left by one bit
-        if(SPI_PIN & (1<<MISO_BIT)) c |= 0x01;  // If bit of slave c is high
-        else c &= ~0x01;                        // if bit of slave c is low
-        SPI_PORT &= ~(1<<SCK_BIT);              // Serial Clock Falling Edge
-    }
+/*
+ * The outcome of an endurance qualification, kept in RAM and saved to
+ * EEPROM. Times are in clock ticks (8 us).
+ */
+typedef struct
+{
+    uint16_t    cycles;         // toggles attempted
+    uint16_t    failures;       // toggles that did not verify
+    uint32_t    worstBusy;      // longest busy time after a CSD write
+    uint32_t    worstVerify;    // longest read back and check
+    uint16_t    busy[HIST_BUCKETS];     // busy time histogram, log2 buckets
+    uint16_t    verify[HIST_BUCKETS];   // verify time histogram, log2 buckets
+} Endurance;
 
-    return c;   // Returns shifted c in value
+/*
+ * A stream of bytes read from consecutive card blocks by the updater.
+ */
+typedef struct
+{
+    uint32_t    block;          // next block to read
+    uint16_t    left;           // bytes left in the current block
+    uint8_t     shift;          // block to address shift, 9 for byte addressed cards
+    uint8_t     open;           // Flag for a block being read
+    uint8_t     failed;         // Flag for a read error, the stream reads 0xff from then on
+} BootStream;
+
+/*
+ * An entry of the SD bus transcript, kept when built with INSTRUMENT=2.
+ * One entry covers one transaction, from CS going low to CS going high.
+ */
+typedef struct
+{
+    uint16_t    start;          // Millis() when CS went low
+    uint16_t    bytes;          // bytes exchanged while selected
+    uint8_t     time;           // ms until CS went high, 255 for longer
+    uint8_t     command;        // first command sent, with bit 6 set, 0 for none
+    uint8_t     response;       // first response byte to it, 0xff for none
+} TraceEntry;
+
+
+
+/*
+ * Local variables
+ */
+uint32_t    LEDPattern; // Blinking patterns
+uint8_t     sdtype;     // Flag for SD card type
+uint8_t     cardReady;  // Flag for registers read successfully
+uint8_t     spiDelay;   // SPI half-period stretch, in delay loop turns (0.5 us each at 8 MHz)
+#ifdef SPI_SAMPLE_DELAY
+uint8_t     spiSample = SPI_SAMPLE_DELAY;   // MISO sampling delay after the rising edge, loop turns
+#endif
+CardRegs    regs;       // Card registers
+uint8_t     csdOriginal[16];    // CSD as read before the last write, for rollback
+uint8_t     csdPending[16];     // CSD being written to the card
+Params      params;     // Runtime parameters, loaded from EEPROM
+Quirk       quirk;      // Quirks of the inserted card, once its CID is known
+uint8_t     sdResponse; // R1 response (or R1_MISSED) of the last failed register read
+uint16_t    recoveries[RUNG_NUM];   // Times each rung of the recovery ladder was climbed, from RUNG_RETRY
+Params      eeParams EEMEM; // Runtime parameters, as saved
+#ifdef AUDIT_LOG
+uint16_t    eeBoots EEMEM;  // Boot count
+AuditRecord eeAudit[AUDIT_LEN] EEMEM;   // Audit log ring
+AuditRecord auditRec;       // Record being filled in or written
+uint16_t    boots;          // Boot count of this power up
+uint8_t     auditHead;      // eeAudit[] slot for the next record, the oldest one
+volatile uint8_t auditLeft; // bytes of auditRec still to write, EEPROM ISR
+uint8_t     *auditAddr;     // EEPROM address past the next byte to write, EEPROM ISR
+#endif
+volatile uint16_t clockTicks;   // ms since the clock was started
+volatile uint16_t deadline;     // clockTicks value that raises EV_DEADLINE
+volatile uint8_t deadlineArmed; // Flag for deadline pending
+volatile uint8_t ledOn;         // Flag for LED meant to be on, restored after sampling the switch
+volatile uint8_t pinWoke;       // Flag for the last power down ended by the switch
+uint8_t     swStable;           // Debounced switch state, clock ISR only
+uint8_t     swCount;            // Samples that disagreed with swStable in a row, clock ISR only
+uint8_t     swTimer;            // ms since the last switch sample, interrupts only
+volatile uint8_t eventHead;     // next slot to push, written by interrupts only
+volatile uint8_t eventTail;     // next slot to pop, written by the main loop only
+volatile uint8_t eventQueue[EVENT_QUEUE_LEN];
+#if INSTRUMENT >= 1
+uint16_t    phaseStart[PHASE_COUNT];    // when each phase last began, ms
+uint8_t     phaseOpen;                  // bit per phase begun and not yet ended
+uint16_t    phaseWorst[PHASE_COUNT];    // longest time each phase has taken, ms
+uint32_t    instrCount[CNT_NUM];        // event counters, see CNT_*
+uint16_t    stackFree = 0xffff;         // least unused stack seen, bytes
+extern uint8_t _end;                    // (linker) end of static data
+extern uint8_t __stack;                 // (linker) top of the stack
+#endif
+#if INSTRUMENT >= 2
+TraceEntry  trace[TRACE_LEN];           // last SD bus transactions
+TraceEntry  *traceOpen;                 // transaction in progress, NULL while deselected
+uint8_t     traceNext;                  // next trace[] entry to write, the oldest
+#endif
+#ifdef TWI_SLAVE
+volatile uint8_t twiPending;    // Flag for a command queued and not yet run
+volatile uint8_t twiState;      // USI two-wire slave state
+volatile uint8_t twiReg;        // current register number
+volatile uint8_t twiGotReg;     // register number already received in this write
+volatile uint8_t twiFailed;     // Flag for last command did not change the card
+Params      twiParams;          // Runtime parameters written by the master, applied on TWI_CMD_APPLY or TWI_CMD_SAVE
+uint16_t    counters[COUNT_NUM];
+#ifdef AUDIT_LOG
+uint16_t    twiAuditPos;        // next audit log byte for the master, from the oldest
+#endif
+#if INSTRUMENT >= 2
+uint8_t     twiTracePos;        // next transcript byte for the master, from the oldest
+#endif
+#endif
+#ifdef READ_SCREENING
+uint16_t    screenLatency;      // worst single block latency from last screening, ms
+uint16_t    screenSpan;         // time to stream the span from last screening, ms
+#endif
+#ifdef FINGERPRINT
+Golden      eeGolden EEMEM = { FP_FIRST_BLOCK, FP_BLOCKS, FP_DIGEST };  // Golden image span and digest
+Fingerprint fingerprint;        // Last fingerprint taken
+#endif
+#ifdef ENDURANCE
+Endurance   eeEndurance EEMEM;  // Last endurance qualification, as saved
+Endurance   endurance;          // Endurance qualification results
+Stamp       csdStamp;           // Start of the CSD write busy time or verify being timed
+uint32_t    busyTicks;          // Busy time of the last CSD write
+uint32_t    verifyTicks;        // Time to read back and check the last CSD write
+#endif
+
+
+/*
+ * CRC7 lookup table, one entry per byte value, generated from CRC7_POLY.
+ * Kept in flash so it costs no RAM and no time to build at boot.
+ */
+static const uint8_t crctable[256] PROGMEM =
+{
+    0x00, 0x09, 0x12, 0x1b, 0x24, 0x2d, 0x36, 0x3f,
+    0x48, 0x41, 0x5a, 0x53, 0x6c, 0x65, 0x7e, 0x77,
+    0x19, 0x10, 0x0b, 0x02, 0x3d, 0x34, 0x2f, 0x26,
+    0x51, 0x58, 0x43, 0x4a, 0x75, 0x7c, 0x67, 0x6e,
+    0x32, 0x3b, 0x20, 0x29, 0x16, 0x1f, 0x04, 0x0d,
+    0x7a, 0x73, 0x68, 0x61, 0x5e, 0x57, 0x4c, 0x45,
+    0x2b, 0x22, 0x39, 0x30, 0x0f, 0x06, 0x1d, 0x14,
+    0x63, 0x6a, 0x71, 0x78, 0x47, 0x4e, 0x55, 0x5c,
+    0x64, 0x6d, 0x76, 0x7f, 0x40, 0x49, 0x52, 0x5b,
+    0x2c, 0x25, 0x3e, 0x37, 0x08, 0x01, 0x1a, 0x13,
+    0x7d, 0x74, 0x6f, 0x66, 0x59, 0x50, 0x4b, 0x42,
+    0x35, 0x3c, 0x27, 0x2e, 0x11, 0x18, 0x03, 0x0a,
+    0x56, 0x5f, 0x44, 0x4d, 0x72, 0x7b, 0x60, 0x69,
+    0x1e, 0x17, 0x0c, 0x05, 0x3a, 0x33, 0x28, 0x21,
+    0x4f, 0x46, 0x5d, 0x54, 0x6b, 0x62, 0x79, 0x70,
+    0x07, 0x0e, 0x15, 0x1c, 0x23, 0x2a, 0x31, 0x38,
+    0x41, 0x48, 0x53, 0x5a, 0x65, 0x6c, 0x77, 0x7e,
+    0x09, 0x00, 0x1b, 0x12, 0x2d, 0x24, 0x3f, 0x36,
+    0x58, 0x51, 0x4a, 0x43, 0x7c, 0x75, 0x6e, 0x67,
+    0x10, 0x19, 0x02, 0x0b, 0x34, 0x3d, 0x26, 0x2f,
+    0x73, 0x7a, 0x61, 0x68, 0x57, 0x5e, 0x45, 0x4c,
+    0x3b, 0x32, 0x29, 0x20, 0x1f, 0x16, 0x0d, 0x04,
+    0x6a, 0x63, 0x78, 0x71, 0x4e, 0x47, 0x5c, 0x55,
+    0x22, 0x2b, 0x30, 0x39, 0x06, 0x0f, 0x14, 0x1d,
+    0x25, 0x2c, 0x37, 0x3e, 0x01, 0x08, 0x13, 0x1a,
+    0x6d, 0x64, 0x7f, 0x76, 0x49, 0x40, 0x5b, 0x52,
+    0x3c, 0x35, 0x2e, 0x27, 0x18, 0x11, 0x0a, 0x03,
+    0x74, 0x7d, 0x66, 0x6f, 0x50, 0x59, 0x42, 0x4b,
+    0x17, 0x1e, 0x05, 0x0c, 0x33, 0x3a, 0x21, 0x28,
+    0x5f, 0x56, 0x4d, 0x44, 0x7b, 0x72, 0x69, 0x60,
+    0x0e, 0x07, 0x1c, 0x15, 0x2a, 0x23, 0x38, 0x31,
+    0x46, 0x4f, 0x54, 0x5d, 0x62, 0x6b, 0x70, 0x79,
+};
+
+
+static const Params defaultParams PROGMEM = PARAMS_DEFAULTS;
+
+
+/*
+ * Card quirk table, first match wins. Add rows above the last one, e.g.
+ *  { 0x1b, "SM",       5,  2000,   0,  1000 },     // a family slow to init and program
+ *  { 0x03, "SDSL",     0,  0,      2,  0    },     // a family that needs a slower SPI clock
+ */
+static const Quirk quirks[] PROGMEM =
+{
+    //  MID   OID+PNM   poll  init  SPI  write
+    {   0,    "",       0,    0,    0,   0   },     // any other card: runtime parameters
+};
+
+
+#ifdef FINGERPRINT
+/*
+ * CRC32 lookup table, one entry per nibble: 64 bytes of flash instead of
+ * the 1 KB byte-wise table, for two lookups per byte.
+ */
+static const uint32_t crc32Table[16] PROGMEM =
+{
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+};
+#endif
+
+
+#ifdef CARD_POLICY
+/*
+ * Fields of the MBR and of a FAT or exFAT boot sector, see MbrFields and
+ * BootFields, and the marker file name.
+ */
+static const Field mbrFields[] PROGMEM =
+{
+    { 454, 4 }, { 510, 2 },
+};
+
+static const Field bootFields[] PROGMEM =
+{
+    { 3, 5 },   { 11, 2 },  { 13, 1 },  { 14, 2 },  { 16, 1 },  { 17, 2 },  { 22, 2 },
+    { 36, 4 },  { 44, 4 },  { 88, 4 },  { 96, 4 },  { 108, 1 }, { 109, 1 }, { 510, 2 },
+};
+
+static const char policyName[] PROGMEM = POLICY_NAME;
+#endif
+
+
+/*
+ * Local functions
+ */
+static void     Select(void);
+static void     Deselect(void);
+static uint8_t  Xchg(uint8_t c);
+static uint8_t  SDInit(void);
+static uint8_t  ReadRegisters(void);
+static uint8_t  ReadRegister(uint8_t command, uint8_t *reg);
+static uint8_t  WriteCSD(const uint8_t *csd);
+static uint8_t  CommitCSD(const uint8_t *csd);
+static uint8_t  Recover(uint8_t *rung);
+static uint8_t  FirstRung(uint8_t response);
+static uint8_t  SupplyIsLow(void);
+
+static uint8_t  SD_send_command(uint8_t command, uint32_t arg);
+static uint8_t  SD_wait_for_data(void);
+
+static uint8_t  AddByteToCRC(uint8_t crc, uint8_t b);
+static uint8_t  RegisterCRC(const uint8_t *reg);
+
+static void     BlinkLED(uint32_t pattern);
+static uint8_t  ReadSwitchOnce(void);
+static void     SampleSwitch(void);
+static uint8_t  CardIsLocked(void);
+static void     ReadState(void);
+static uint8_t  ChangeState(void);
+static void     ShowState(void);
+static uint8_t  ToggleState(void);
+
+static void     FindQuirk(void);
+#ifdef SPI_SAMPLE_CAL
+static void     CalibrateSampling(void);
+#endif
+static void     LoadParams(void);
+static void     SaveParams(void);
+static void     DefaultParams(void);
+static uint8_t  ParamsSum(void);
+static uint8_t  ParamsValid(const Params *p);
+
+static void     StartClock(void);
+static uint16_t Millis(void);
+static void     Delay(uint16_t ms);
+static void     SetDeadline(uint16_t ms);
+static void     PushEvent(uint8_t event);
+static uint8_t  PopEvent(void);
+static uint8_t  SleepUntilPress(void);
+#ifdef AUDIT_LOG
+static void     AuditInit(void);
+static void     AuditBegin(uint8_t action);
+static void     AuditEnd(uint8_t result);
+static void     AuditWait(void);
+#endif
+#if INSTRUMENT >= 1
+static void     PhaseBegin(uint8_t phase);
+static void     PhaseEnd(uint8_t phase);
+static void     PaintStack(void) __attribute__((naked, used, section(".init1")));
+static void     CheckStack(void);
+#endif
+#if INSTRUMENT >= 2
+static void     TraceSelect(void);
+static void     TraceDeselect(void);
+static void     TraceByte(void);
+static void     TraceCommand(uint8_t command, uint8_t response);
+#endif
+
+#ifdef TWI_SLAVE
+static void     TwiAttach(void);
+static void     TwiDetach(void);
+static void     TwiRunCommand(uint8_t event);
+static uint8_t  TwiRead(uint8_t reg);
+static void     TwiWrite(uint8_t reg, uint8_t value);
+#endif
+
+#ifdef UPDATER
+static void     BootEntry(void) __attribute__((naked, used, section(".bootentry")));
+static void     BootResume(void) BOOTLOADER __attribute__((noreturn));
+static void     BootUpdate(void) BOOTLOADER;
+static uint8_t  BootCheck(uint16_t *length) BOOTLOADER;
+static uint8_t  BootFlash(uint16_t length) BOOTLOADER;
+static uint8_t  BootWritePage(BootStream *s, uint16_t addr, uint8_t patch) BOOTLOADER;
+static uint8_t  BootVerify(uint16_t length, uint8_t shift, uint16_t first) BOOTLOADER;
+static uint8_t  BootInit(void) BOOTLOADER;
+static void     BootOpen(BootStream *s, uint32_t block, uint8_t shift) BOOTLOADER;
+static uint8_t  BootByte(BootStream *s) BOOTLOADER;
+static void     BootClose(BootStream *s) BOOTLOADER;
+static uint8_t  BootCommand(uint8_t command, uint32_t arg) BOOTLOADER;
+static void     BootDeselect(void) BOOTLOADER;
+static uint8_t  BootXchg(uint8_t c) BOOTLOADER;
+#endif
+
+#ifdef FINGERPRINT
+static uint8_t  FingerprintCard(void);
+static uint32_t Crc32Byte(uint32_t crc, uint8_t data);
+#endif
+
+#ifdef ENDURANCE
+static void     Qualify(void);
+static uint8_t  HistBucket(uint32_t ticks);
+static void     TakeStamp(Stamp *stamp);
+static uint32_t TicksSince(const Stamp *stamp);
+#endif
+
+#ifdef CARD_POLICY
+static uint8_t  CardWantsLock(void);
+static uint8_t  ScanDirectory(uint32_t block, uint16_t blocks, uint8_t exfat);
+static uint8_t  ReadFields(uint32_t block, const Field *fields, uint8_t count, void *out);
+static uint8_t  SD_start_block_read(uint32_t block);
+static void     SD_end_block_read(void);
+#endif
+
+#if defined(READ_SCREENING) || defined(CARD_POLICY) || defined(FINGERPRINT)
+static uint32_t BlockAddress(uint32_t block);
+static uint8_t  SD_wait_for_block(void);
+#endif
+#if defined(READ_SCREENING) || defined(FINGERPRINT)
+static uint8_t  SD_stop_transmission(void);
+#endif
+#ifdef READ_SCREENING
+static void     SD_skip_block(void);
+static uint8_t  ScreenCard(void);
+#endif
+
+
+
+int main(void)
+{
+    uint8_t event;  // Next event from the interrupts
+    uint8_t held;   // Button held at power on
+
+    // Set up the hardware lines and ports associated with accessing the SD card.
+    SPI_PORT |= (1<<MOSI_BIT) | (1<<SCK_BIT);                   // drive outputs to the SPI port
+    SPI_DDR  |= (1<<CS_BIT) | (1<<MOSI_BIT) | (1<<SCK_BIT);     // make the proper lines outputs
+    SPI_PORT |= (1<<MISO_BIT);                                  // turn on pull-up for input
+    Deselect();                 // Start with SD card disabled
+
+    LoadParams();               // Needed before anything is timed
+#ifdef AUDIT_LOG
+    AuditInit();
+#endif
+
+    PRR  = (1<<PRTIM0) | (1<<PRUSI) | (1<<PRADC);   // Power down unused peripherals
+    ACSR = (1<<ACD);                                // including the analog comparator
+    set_sleep_mode(SLEEP_MODE_IDLE);                // Delays sleep until the next clock tick
+
+    StartClock();               // Needed for all delays and timeouts
+    INSTR_PHASE_BEGIN(PHASE_BOOT);
+
+    LEDSW_AS_LED;               // Set shared LED/switch pin as output (LED)
+    cli();                      // (the clock ISR samples the switch too)
+    held = ReadSwitchOnce();
+    sei();
+    BlinkLED(PATTERN_BOOTING);  // Test LED on power on
+    cli();
+    held = held && ReadSwitchOnce();
+    if (held)                   // Button held through the LED test...
+    {
+        swStable = SW_PRESSED;  // ...is not a toggle request,
+    }
+    sei();
+    if (held)
+    {
+        while (PopEvent() != EV_NONE)
+        {
+            ;
+        }
+#ifdef UPDATER
+        cli();                  // the updater runs without interrupts...
+        ((void (*)(void))(uintptr_t)(UPDATER_UPDATE / 2))();    // ...and only returns if the card holds no valid image
+        sei();
+#endif
+        DefaultParams();        // it restores the default parameters
+        SaveParams();
+        BlinkLED(PATTERN_DEFAULTS);
+    }
+#ifdef TWI_SLAVE
+    twiParams = params;         // the master starts from the parameters in use, defaults or not
+#endif
+    ReadState();                // Read the card for the first time
+    INSTR_PHASE_END(PHASE_BOOT);
+
+#ifdef AUTO_LOCK
+    if (cardReady && !CardIsLocked())   // Lock each card as soon as it is inserted
+    {
+        ChangeState();
+    }
+#endif
+#ifdef AUTO_UNLOCK
+    if (cardReady && CardIsLocked())    // Unlock each card as soon as it is inserted
+    {
+        ChangeState();
+    }
+#endif
+#ifdef CARD_POLICY
+    if (cardReady && !CardIsLocked() && CardWantsLock())    // Lock marked cards as soon as they are inserted
+    {
+        ChangeState();
+    }
+#endif
+#ifdef ENDURANCE
+    if (cardReady)              // Qualify each card as soon as it is inserted
+    {
+        Qualify();
+    }
+#endif
+
+    while (1)
+    {
+#ifdef TWI_SLAVE
+        TwiAttach();                // Listen to the control interface while the card is idle
+#endif
+
+        ShowState();                // Display the current state
+        INSTR_STACK();
+        if (SleepUntilPress())      // Nothing to do, power down until the button moves or the host talks
+        {
+            INSTR_PHASE_BEGIN(PHASE_WAKE);
+        }
+
+        event = PopEvent();
+        switch (event)
+        {
+        case EV_PRESS:              // If the user presses the button...
+            INSTR_PHASE_END(PHASE_WAKE);
+            if (cardReady)
+            {
+                INSTR_PHASE_BEGIN(PHASE_TOGGLE);
+                ChangeState();          // try to toggle the card
+                ShowState();            // and display the updated state
+                INSTR_PHASE_END(PHASE_TOGGLE);
+            }
+            break;
+
+        case EV_DEADLINE:           // If a faulty card is due for another try...
+            if (!cardReady)
+            {
+                ReadState();            // ...read it again
+            }
+            break;
+
+#ifdef TWI_SLAVE
+        case EV_LOCK:               // If the control interface sent a command...
+        case EV_UNLOCK:
+        case EV_SAVE:
+        case EV_DEFAULTS:
+        case EV_APPLY:
+            TwiRunCommand(event);   // ...run it
+            break;
+#endif
+        }
+    } // end main while (1) loop
+
+    return 0; // should never be reached
+}
+
+
+
+/*
+ * ChangeState()
+ * Toggles the locked/unlocked state of the card and verifies the change,
+ * blinking an error pattern if it did not take effect.
+ * Returns TRUE if the card changed state.
+ */
+static uint8_t ChangeState(void)
+{
+    uint8_t prevState; // State of the card before the change
+    uint8_t r;
+
+#ifdef TWI_SLAVE
+    TwiDetach();                    // the card needs the shared lines back
+#endif
+    prevState = CardIsLocked();     // remember the current state
+    AUDIT_BEGIN(prevState ? AUDIT_UNLOCK : AUDIT_LOCK);
+#ifdef READ_SCREENING
+    if (!prevState && (ScreenCard() != SCREEN_PASS))  // before locking, reject slow cards
+    {
+        AUDIT_END(AUDIT_SLOW);
+        BlinkLED(PATTERN_SLOWCARD); // blink slow card a few times
+        BlinkLED(PATTERN_SLOWCARD);
+        BlinkLED(PATTERN_SLOWCARD);
+        ReadState();                // leave the card in a known state
+        return FALSE;
+    }
+#endif
+#ifdef FINGERPRINT
+    if (!prevState && (FingerprintCard() != FP_MATCH))  // before locking, check the image
+    {
+        AUDIT_END(AUDIT_MISMATCH);
+        BlinkLED(PATTERN_MISMATCH); // blink mismatch a few times
+        BlinkLED(PATTERN_MISMATCH);
+        BlinkLED(PATTERN_MISMATCH);
+        ReadState();                // leave the card in a known state
+        return FALSE;
+    }
+#endif
+
+    // Attempt to change it; the commit reads it back to verify the change.
+    // If that failed the card may hold anything, so put the original CSD
+    // back, and only fall back to a full re-init if even that fails.
+    r = ToggleState();
+    if (r == SDCARD_LOWVCC)         // nothing was sent, the card is as it was
+    {
+        AUDIT_END(AUDIT_LOWVCC);
+#ifdef TWI_SLAVE
+        counters[COUNT_FAILURES]++;
+#endif
+        return FALSE;
+    }
+    if ((r != SDCARD_OK) && (CommitCSD(csdOriginal) != SDCARD_OK))
+    {
+        ReadState();
+    }
+
+    if (!cardReady || (CardIsLocked() == prevState))    // if state did not change as expected
+    {
+        AUDIT_END(AUDIT_FAILED);
+#ifdef TWI_SLAVE
+        counters[COUNT_FAILURES]++;
+#endif
+        BlinkLED(PATTERN_FAILED);   // blink error a few times
+        BlinkLED(PATTERN_FAILED);
+        BlinkLED(PATTERN_FAILED);
+        return FALSE;
+    }
+
+    AUDIT_END(AUDIT_OK);
+#ifdef TWI_SLAVE
+    counters[prevState ? COUNT_UNLOCKS : COUNT_LOCKS]++;
+#endif
+    return TRUE;
+}
+
+
+
+/*
+ * SampleSwitch()
+ * Debounces the switch, called from the clock ISR every ms. The switch is
+ * sampled every params.debounceInterval ms, and a new state is accepted once
+ * params.debounceCount samples in a row agree on it. Pushes EV_PRESS on a press.
+ */
+static void SampleSwitch(void)
+{
+    uint8_t state;
+
+    if (++swTimer < params.debounceInterval)
+    {
+        return;
+    }
+    swTimer = 0;
+
+    state = ReadSwitchOnce();
+    if (state == swStable)  // no change, restart the debounce check
+    {
+        swCount = 0;
+        return;
+    }
+    if (++swCount >= params.debounceCount)
+    {
+        swStable = state;
+        swCount = 0;
+        if (state == SW_PRESSED)
+        {
+            PushEvent(EV_PRESS);
+        }
+    }
+}
+
+
+
+/*
+ * ReadSwitchOnce()
+ * Checks if the switch is closed. NO debouncing.
+ * Also handles I/O switching for the shared LEDSW pin, so that line
+ * is always set as an output (LED) outside of this function.
+ */
+static uint8_t ReadSwitchOnce(void)
+{
+    uint8_t switchState;
+
+    TURN_LED_OFF;   // Set line high to turn off LED
+    LEDSW_AS_SW;    // Set shared pin as input (switch)
+    SW_PULLUP;      // Enable internal pull-up by setting line high again
+
+    switchState = SW_GET_STATE;
+
+    LEDSW_AS_LED;     // Set shared pin as output (LED) again
+    if (ledOn)        // and if needed,
+    {
+        TURN_LED_ON;  // turn LED back on before returning
+    }
+
+    return switchState;
+}
+
+
+
+/*
+ * BlinkLED(pattern)
+ * Makes the LED blink in the specified pattern.
+ */
+void BlinkLED(uint32_t pattern)
+{
+    uint8_t i;
+    for (i=0; i<32; i++)
+    {
+        ledOn = (pattern & 0x80000000) ? TRUE : FALSE;  // set first, the switch sampling restores it
+        if (ledOn)
+        {
+            TURN_LED_ON;
+        }
+        else
+        {
+            TURN_LED_OFF;
+        }
+        Delay(params.blinkStep);
+        pattern = pattern << 1;
+        if (pattern == 0)
+        {
+            break; // leave blink loop if no more ON bits
+        }
+    }
+}
+
+
+
+/*
+ * ReadState()
+ * Read the locked/unlocked state from the card.
+ * Gives up after READ_RETRIES failed initializations, or once the register
+ * read has climbed the whole recovery ladder, leaving cardReady cleared and
+ * a deadline set for the next try.
+ */
+static void ReadState(void)
+{
+    uint8_t r;
+    uint8_t tries;
+    uint8_t rung;
+
+#ifdef TWI_SLAVE
+    TwiDetach();    // the card needs the shared lines back
+#endif
+
+    for (tries=0; tries<READ_RETRIES; tries++)
+    {
+        // In all cases, try first to initialize the card.
+        INSTR_PHASE_BEGIN(PHASE_INIT);
+        r = SDInit();
+        INSTR_PHASE_END(PHASE_INIT);
+        if (r != SDCARD_OK)
+        {
+            BlinkLED(PATTERN_LOADING);
+            continue; // keep trying
+        }
+
+        // Card initialized, now take a snapshot of its registers
+        INSTR_PHASE_BEGIN(PHASE_REGS);
+        rung = RUNG_NONE;
+        do
+        {
+            r = ReadRegisters();
+        } while ((r != SDCARD_OK) && Recover(&rung));
+        INSTR_PHASE_END(PHASE_REGS);
+        if (r != SDCARD_OK)
+        {
+            BlinkLED(PATTERN_READING);
+            break;  // re-init did not help either
+        }
+
+        cardReady = TRUE;
+        return;
+    }
+    cardReady = FALSE; // give up for now, card is faulty
+    SetDeadline(READ_RETRY_DELAY);
+}
+
+
+
+/*
+ * ShowState()
+ * Shows the locked/unlocked state of the card, using the LED
+ * LED steadily on  = card is locked (write-protected)
+ * LED off          = card is unlocked
+ * LED slow blink   = card is faulty
+ */
+static void ShowState(void)
+{
+    if (!cardReady)
+    {
+        BlinkLED(PATTERN_FAILED);
+    }
+    else if (CardIsLocked())
+    {
+        BlinkLED(PATTERN_LOCKED);
+    }
+    else
+    {
+        BlinkLED(PATTERN_UNLOCKED);
+    }
+}
+
+
+
+/*
+ * ToggleState:
+ * Toggle the locked/unlocked state on the card. The current CSD is kept in
+ * csdOriginal[] and the new one built in csdPending[], so regs.csd[] only
+ * ever holds what was read from the card.
+ * Returns the result of the CSD commit, or SDCARD_LOWVCC without writing
+ * if the supply is too low.
+ */
+static uint8_t ToggleState(void)
+{
+    uint8_t r;
+
+    if (SupplyIsLow())      // a write on a sagging supply may corrupt the CSD
+    {
+        BlinkLED(PATTERN_LOWVCC);   // ...so leave the card alone for now
+        BlinkLED(PATTERN_LOWVCC);
+        BlinkLED(PATTERN_LOWVCC);
+        return SDCARD_LOWVCC;
+    }
+
+    memcpy(csdOriginal, regs.csd, sizeof(csdOriginal));    // snapshot for rollback
+    memcpy(csdPending, regs.csd, sizeof(csdPending));
+    if (CardIsLocked())     // get ready to unlock it
+    {
+        csdPending[14] &= ~LOCK_BIT_MASK;   // clear bit 12 of CSD (temp lock)
+    }
+    else                    // otherwise, get ready to lock it
+    {
+        csdPending[14] |= LOCK_BIT_MASK;    // set bit 12 of CSD (temp lock)
+    }
+
+    INSTR_PHASE_BEGIN(PHASE_WRITE);
+    r = CommitCSD(csdPending);  // Attempt to write the new state to the card.
+    INSTR_PHASE_END(PHASE_WRITE);
+    if (r != SDCARD_OK) // If state not properly written...
+    {
+        BlinkLED(PATTERN_WERROR);   // ...notify this error
+        BlinkLED(PATTERN_WERROR);
+        BlinkLED(PATTERN_WERROR);
+    }
+    return r;
+}
+
+
+
+/*
+ * CardIsLocked()
+ * Returns 1 if the card is locked, 0 otherwise
+ */
+static uint8_t CardIsLocked(void)
+{
+    return (regs.csd[14] & LOCK_BIT_MASK); // check lock bit from CSD
+}
+
+
+
+/*
+ * SupplyIsLow()
+ * Measures Vcc against the internal bandgap. The ADC is powered up only
+ * for the measurement. Returns TRUE if Vcc is below VCC_MIN.
+ */
+static uint8_t SupplyIsLow(void)
+{
+    uint8_t     i;
+    uint16_t    adc = 0;
+
+    PRR &= ~(1<<PRADC);
+    ADMUX = VBG_MUX;
+    ADCSRA = (1<<ADEN) | (1<<ADPS2) | (1<<ADPS1);   // 125 kHz ADC clock at 8 MHz
+    Delay(VBG_SETTLE);
+    for (i=0; i<2; i++)     // the first conversion after selecting the bandgap is off
+    {
+        ADCSRA |= (1<<ADSC);
+        while (ADCSRA & (1<<ADSC))
+        {
+            ;
+        }
+        adc = ADC;
+    }
+    ADCSRA = 0;             // the ADC must be disabled before powering it down
+    PRR |= (1<<PRADC);
+
+    return (adc > VCC_ADC_MAX);
+}
+
+
+
+/*
+ * Select()
+ * Selects (CS enable) the SD card.
+ */
+static void Select(void)
+{
+    SPI_PORT &= ~(1<<CS_BIT);
+    INSTR_SELECT();
+}
+
+
+
+/*
+ * Deselect:
+ * Deselects (CS disable) the SD card.
+ */
+static void Deselect(void)
+{
+    SPI_PORT |= (1<<CS_BIT);
+    INSTR_DESELECT();
+}
+
+
+
+/*
+ * Xchg(c)
+ * Exchange a byte of data with the SD card via host's SPI bus.
+ */
+static uint8_t Xchg(uint8_t c)
+{
+    uint8_t bit = 0;
+    uint8_t d;
+
+    INSTR_COUNT(CNT_XCHG);
+    INSTR_TRACE_BYTE();
+
+    // I tried to get the SPI to work following Atmel's USI specs, and failed
+    // However, bit-banging works, so I'm going with that.
+    for (bit=0; bit<8; bit++)   // Loop through 8 bits
+    {
+        if(c & 0x80) SPI_PORT |= (1<<MOSI_BIT); // If bit(7) of "c" is high
+        else SPI_PORT &= ~(1<<MOSI_BIT);        // if bit(7) of "c" is low
+        for (d=spiDelay; d; d--) __asm__ __volatile__ ("nop");  // stretch low phase
+        SPI_PORT |= (1<<SCK_BIT);               // Serial Clock Rising Edge
+        c <<= 1;                                // Shift "c" to the left by one bit
+#ifdef SPI_SAMPLE_DELAY
+        for (d=spiSample; d; d--) __asm__ __volatile__ ("nop");  // let MISO settle
+#endif
+        if(SPI_PIN & (1<<MISO_BIT)) c |= 0x01;  // If bit of slave c is high
+        else c &= ~0x01;                        // if bit of slave c is low
+        for (d=spiDelay; d; d--) __asm__ __volatile__ ("nop");  // stretch high phase
+        SPI_PORT &= ~(1<<SCK_BIT);              // Serial Clock Falling Edge
+    }
+
+    return c;   // Returns shifted c in value
+}
+
+
+
+/*
+ * SDInit()
+ * Initialize the SD card.
+ */
+static uint8_t SDInit(void)
+{
+    uint16_t    i;
+    uint16_t    start;
+    uint8_t     response;
+
+    sdtype = SDTYPE_UNKNOWN;    // assume this fails
+    spiDelay = SPI_INIT_DELAY;  // cards must be initialized with SCK under 400 kHz
+    /*
+     * Begin initialization by sending CMD0 and waiting until SD card
+     * responds with In Idle Mode (0x01). If the response is not 0x01
+     * within a reasonable amount of time, there is no SD card on the bus.
+     */
+    Deselect();             // always make sure card was not selected
+    for (i=0; i<10; i++)    // send several clocks while card power stabilizes
+    {
+        Xchg(0xff);
+    }
+
+    for (i=0; i<10; i++)
+    {
+        response = SD_send_command(SD_GO_IDLE, 0);  // send CMD0 - go to idle state
+        if (response == 0x01)
+        {
+            break;
+        }
+    }
+    if (response != 0x01)
+    {
+        memset(&quirk, 0, sizeof(quirk));   // no card, the next one starts on the runtime parameters
+        return SDCARD_NOT_DETECTED;
+    }
+
+    response = SD_send_command(SD_SEND_IF_COND, 0x1aa); // check if card is SDv2 (SDHC)
+    if (response == 0x01)                               // if card is SDHC...
+    {
+        Xchg(0xff);                                     // burn the first 2 bytes of the R7 response
+        Xchg(0xff);
+        if (((Xchg(0xff) & 0x0f) != 0x01) || (Xchg(0xff) != 0xaa))  // voltage and check pattern
+        {
+            Deselect();
+            return SDCARD_NOT_DETECTED;                 // garbled response, or card can't do 3.3V
+        }
+        start = Millis();
+        do
+        {
+            Delay(QUIRK_OR_PARAM(initPoll));
+            response = SD_send_command(SD_ADV_INIT, 1UL<<30);
+        } while ((response != 0) && ((uint16_t)(Millis() - start) < QUIRK_OR_PARAM(initTimeout)));
+        if (response != 0)
+        {
+            return SDCARD_TIMEOUT;                      // card never left the idle state
+        }
+        response = SD_send_command(SD_READ_OCR, 0);     // CCS is only valid once the card is ready
+        if (response != 0)
+        {
+            Deselect();
+            return SDCARD_NOT_DETECTED;
+        }
+        response = Xchg(0xff);                          // OCR byte 0 holds CCS
+        for (i=0; i<3; i++)                             // burn the rest of the OCR
+        {
+            Xchg(0xff);
+        }
+        Deselect();
+        if (response & OCR_CCS_MASK)
+        {
+            sdtype = SDTYPE_SDHC;                       // block addressed
+        }
+        else
+        {
+            SD_send_command(SD_SET_BLK_LEN, 512);       // SD v2 card, but standard capacity
+            sdtype = SDTYPE_SD;
+        }
+    }
+    else
+    {                                               // if card is SD...
+        response = SD_send_command(SD_READ_OCR, 0);
+        if (response != 0x01)
+        {
+            Deselect();
+            return SDCARD_NOT_DETECTED;
+        }
+        for (i=0; i<4; i++)                         // burn the 4-byte response (OCR)
+        {
+            Xchg(0xff);
+        }
+        start = Millis();
+        do
+        {
+            Delay(QUIRK_OR_PARAM(initPoll));
+            response = SD_send_command(SD_INIT, 0);
+        } while ((response != 0) && ((uint16_t)(Millis() - start) < QUIRK_OR_PARAM(initTimeout)));
+        if (response != 0)
+        {
+            return SDCARD_TIMEOUT;                  // card never left the idle state
+        }
+        SD_send_command(SD_SET_BLK_LEN, 512);
+        sdtype = SDTYPE_SD;
+    }
+
+    /*
+     * Identify the card while the clock is still slow, so a card that needs
+     * a slower SPI clock is never run faster. If the CID can't be read, the
+     * runtime parameters apply and ReadRegisters() reports the failure.
+     */
+    if (ReadRegister(SD_SEND_CID, regs.cid) != SDCARD_OK)
+    {
+        memset(regs.cid, 0, sizeof(regs.cid));  // matches the last row only
+    }
+    FindQuirk();
+
+    Xchg(0xff); // send 8 final clocks
+
+    /*
+     * At this point, the SD card has completed initialization, so the SPI clock
+     * rate can be increased up to the maximum allowed by the SD card (typically,
+     * 20 MHz, well above what bit-banging reaches), or by its quirks.
+     */
+    spiDelay = (quirk.spiDelay > SPI_FAST_DELAY) ? quirk.spiDelay : SPI_FAST_DELAY;
+#ifdef SPI_SAMPLE_CAL
+    CalibrateSampling();    // at the final clock rate
+#endif
+
+    return SDCARD_OK;   // if no power routine or turning off the card, call it good
+}
+
+
+
+/*
+ * ReadRegisters()
+ * Takes a snapshot of the card registers (OCR, CID, CSD and status) into
+ * regs, in a single session right after initialization. The snapshot only
+ * reads the card: its type was settled by SDInit().
+ */
+static uint8_t ReadRegisters(void)
+{
+    uint8_t i;
+    uint8_t response;
+
+    memset(&regs, 0, sizeof(regs));
+
+    response = SD_send_command(SD_READ_OCR, 0); // R3 response, R1 plus the OCR
+    if (response != 0)
+    {
+        Deselect();
+        sdResponse = response;
+        return SDCARD_RWFAIL;
+    }
+    for (i=0; i<4; i++)
+    {
+        regs.ocr[i] = Xchg(0xff);
+    }
+
+    if (ReadRegister(SD_SEND_CID, regs.cid) != SDCARD_OK)
+    {
+        return SDCARD_RWFAIL;
+    }
+
+    if (ReadRegister(SD_SEND_CSD, regs.csd) != SDCARD_OK)
+    {
+        return SDCARD_RWFAIL;
+    }
+
+    regs.status[0] = SD_send_command(SD_SEND_STATUS, 0);    // R2 response
+    regs.status[1] = Xchg(0xff);
+    Deselect();
+    Xchg(0xff);
+
+    return SDCARD_OK;
+}
+
+
+
+/*
+ * FindQuirk()
+ * Looks up the quirks of the card from its CID, into quirk.
+ */
+static void FindQuirk(void)
+{
+    uint8_t i;
+    uint8_t j;
+    uint8_t c;
+
+    for (i=0; i<sizeof(quirks)/sizeof(quirks[0]); i++)
+    {
+        memcpy_P(&quirk, &quirks[i], sizeof(quirk));
+        if (quirk.mid && (quirk.mid != regs.cid[0]))
+        {
+            continue;
+        }
+        for (j=0; j<7; j++)
+        {
+            c = quirk.id[j];
+            if (c && (c != regs.cid[1 + j]))
+            {
+                break;
+            }
+        }
+        if (j == 7)
+        {
+            return;     // all set fields match
+        }
+    }
+}
+
+
+
+#ifdef SPI_SAMPLE_CAL
+/*
+ * CalibrateSampling()
+ * Tries MISO sampling delays from 0 up to SPI_SAMPLE_MAX, reading the CID
+ * twice with each and checking its CRC, and stops at the first one that
+ * reads correctly. Sampling later never fails, as the delay only stretches
+ * the high phase of SCK, so every longer delay would just slow the bus
+ * down: picks the shortest good one plus SPI_SAMPLE_MARGIN. Keeps the
+ * previous delay if none works.
+ */
+static void CalibrateSampling(void)
+{
+    uint8_t d;
+    uint8_t prev;
+
+    prev = spiSample;
+    for (d=0; d<=SPI_SAMPLE_MAX; d++)
+    {
+        spiSample = d;
+        if ((ReadRegister(SD_SEND_CID, regs.cid) == SDCARD_OK) &&
+            (ReadRegister(SD_SEND_CID, regs.cid) == SDCARD_OK))
+        {
+            break;
+        }
+    }
+    Deselect();
+    Xchg(0xff);
+
+    spiSample = (d > SPI_SAMPLE_MAX) ? prev : d + SPI_SAMPLE_MARGIN;
+}
+#endif
+
+
+
+/*
+ * ReadRegister(command, reg)
+ * Reads a 16-byte register (CID or CSD) sent as a data block, into reg.
+ * On failure, leaves the R1 response in sdResponse, or R1_MISSED if the
+ * data never came or came corrupted.
+ */
+static uint8_t ReadRegister(uint8_t command, uint8_t *reg)
+{
+    uint8_t i;
+    uint8_t response;
+
+    response = SD_send_command(command, 0);
+    sdResponse = response;
+    if (response == 0)
+    {
+        response = SD_wait_for_data();
+        sdResponse = R1_MISSED;     // an error token is treated as a glitch too
+    }
+    if (response != 0xfe)
+    {
+        Deselect();
+        return SDCARD_RWFAIL;
+    }
+
+    for (i=0; i<16; i++)
+    {
+        reg[i] = Xchg(0xff);
+    }
+
+    Xchg(0xff); // burn the CRC
+    Xchg(0xff);
+
+    // The register carries its own CRC7 in the last byte, check it so a
+    // corrupted CSD is never written back to the card.
+    if (reg[15] != RegisterCRC(reg))
+    {
+        Deselect();
+        sdResponse = R1_MISSED;
+        return SDCARD_RWFAIL;
+    }
+    return SDCARD_OK;
+}
+
+
+
+/*
+ * WriteCSD(csd)
+ * Writes the first 15 bytes of csd[] to the CSD on the card, followed by
+ * their CRC7, then waits while the card programs it. Returns SDCARD_RWFAIL
+ * if the card rejects the data, SDCARD_TIMEOUT if it stays busy too long.
+ */
+static uint8_t WriteCSD(const uint8_t *csd)
+{
+    uint8_t     response;
+    uint8_t     i;
+    uint16_t    start;
+
+    response = SD_send_command(SD_PROGRAM_CSD, 0);
+    if (response != 0)
+    {
+        Deselect();
+        return SDCARD_RWFAIL;
+    }
+
+    Xchg(0xfe); // send data token marking start of data block
+
+    for (i=0; i<15; i++)    // for all 15 data bytes in CSD...
+    {
+        Xchg(csd[i]);           // send each byte via SPI
+    }
+    Xchg(RegisterCRC(csd));     // send the formatted CRC7 value
+
+    Xchg(0xff);         // ignore dummy checksum
+    Xchg(0xff);         // ignore dummy checksum
+
+    response = Xchg(0xff);  // data response token, xxx0sss1
+    if ((response & DATA_RESP_MASK) != DATA_RESP_ACCEPTED)
+    {
+        Deselect();
+        return SDCARD_RWFAIL;   // CRC error or write error, nothing programmed
+    }
+
+#ifdef ENDURANCE
+    TakeStamp(&csdStamp);   // busy time runs from the token to DO going high
+#endif
+    start = Millis();
+    while (Xchg(0xff) != 0xff)  // card holds DO low while busy programming
+    {
+        INSTR_COUNT(CNT_BUSY);
+        if ((uint16_t)(Millis() - start) >= QUIRK_OR_PARAM(writeTimeout))
+        {
+            Deselect();
+            return SDCARD_TIMEOUT;  // nope, didn't work
+        }
+    }
+#ifdef ENDURANCE
+    busyTicks = TicksSince(&csdStamp);
+#endif
+    return SDCARD_OK;       // return success
+}
+
+
+
+/*
+ * CommitCSD(csd)
+ * Writes csd[] to the card and reads the registers back to verify it.
+ * The card is still initialized after a good write, so no re-init is
+ * needed. Returns SDCARD_OK only if the card now holds csd[].
+ */
+static uint8_t CommitCSD(const uint8_t *csd)
+{
+    uint8_t r;
+    uint8_t rung;
+
+    r = WriteCSD(csd);
+#ifdef ENDURANCE
+    TakeStamp(&csdStamp);
+#endif
+    if (r == SDCARD_OK)
+    {
+        rung = RUNG_NONE;
+        do
+        {
+            r = ReadRegisters();
+        } while ((r != SDCARD_OK) && Recover(&rung));
+    }
+    if ((r == SDCARD_OK) && (memcmp(regs.csd, csd, 15) != 0))
+    {
+        r = SDCARD_RWFAIL;      // written, but not what was asked for
+    }
+#ifdef ENDURANCE
+    verifyTicks = TicksSince(&csdStamp);
+#endif
+    return r;
+}
+
+
+
+/*
+ * Recover(rung)
+ * Climbs the recovery ladder after a failed register read, from the rung
+ * last tried (RUNG_NONE at first) or the first one that can fix the
+ * failure in sdResponse, whichever is higher. Each rung climbed is counted
+ * in recoveries[]. Returns TRUE if the read should be tried again, FALSE
+ * once the card is given up as faulty.
+ */
+static uint8_t Recover(uint8_t *rung)
+{
+    uint8_t i;
+    uint8_t r;
+    uint8_t next;
+
+    next = FirstRung(sdResponse);
+    if (next <= *rung)
+    {
+        next = *rung + 1;
+    }
+    for (;;)
+    {
+        *rung = next;
+        recoveries[next - RUNG_RETRY]++;
+        switch (next)
+        {
+        case RUNG_RETRY:
+            return TRUE;
+
+        case RUNG_RESYNC:           // let the card finish sending whatever it was
+            Deselect();
+            for (i=0; i<RESYNC_BYTES; i++)
+            {
+                Xchg(0xff);
+            }
+            return TRUE;
+
+        case RUNG_RESELECT:         // the card must still be in the transfer state
+            Deselect();
+            Delay(RESELECT_PAUSE);
+            r = SD_send_command(SD_SEND_STATUS, 0);     // R2 response
+            Xchg(0xff);
+            Deselect();
+            Xchg(0xff);
+            if (r == 0)
+            {
+                return TRUE;
+            }
+            break;                  // it is not, climb on
+
+        case RUNG_REINIT:
+            INSTR_PHASE_BEGIN(PHASE_INIT);
+            r = SDInit();
+            INSTR_PHASE_END(PHASE_INIT);
+            if (r == SDCARD_OK)
+            {
+                return TRUE;
+            }
+            break;
+
+        default:                    // RUNG_FAULT
+            return FALSE;
+        }
+        next++;
+    }
+}
+
+
+
+/*
+ * FirstRung(response)
+ * Classifies a failed read by its R1 response, returns the lowest rung of
+ * the recovery ladder that can fix it. A missed or corrupted exchange is
+ * worth sending again, a card back in the idle state was reset and needs
+ * a re-init, and a command the card rejected will not do better the next
+ * time.
+ */
+static uint8_t FirstRung(uint8_t response)
+{
+    if (response == R1_MISSED)
+    {
+        return RUNG_RETRY;
+    }
+    if (response & 0x80)        // not a valid R1, out of step with the card
+    {
+        return RUNG_RESYNC;
+    }
+    if (response & R1_IDLE)
+    {
+        return RUNG_REINIT;
+    }
+    if (response & R1_CRC_ERROR)
+    {
+        return RUNG_RETRY;
+    }
+    return RUNG_FAULT;
+}
+
+
+
+#ifdef READ_SCREENING
+/*
+ * ScreenCard()
+ * Measures the read performance of the card over the screening span.
+ * Records the worst single block latency and the time taken to stream the
+ * whole span, and returns SCREEN_PASS, SCREEN_SLOW or SCREEN_ERROR.
+ */
+static uint8_t ScreenCard(void)
+{
+    uint16_t    i;
+    uint16_t    start;
+    uint16_t    elapsed;
+    uint8_t     r;
+
+    // Latency pass: one CMD17 per block, worst time to the data token
+    screenLatency = 0;
+    for (i=0; i<SCREEN_BLOCKS; i++)
+    {
+        start = Millis();
+        r = SD_send_command(SD_READ_BLK, BlockAddress(SCREEN_FIRST_BLOCK + (uint32_t)i));
+        if (r == 0)
+        {
+            r = SD_wait_for_block();
+        }
+        elapsed = Millis() - start;
+        if (r != 0xfe)
+        {
+            Deselect();
+            return SCREEN_ERROR;
+        }
+        SD_skip_block();
+        Deselect();
+        if (elapsed > screenLatency)
+        {
+            screenLatency = elapsed;
+        }
+    }
+
+    // Throughput pass: the whole span with a single CMD18
+    start = Millis();
+    r = SD_send_command(SD_READ_MULTI_BLK, BlockAddress(SCREEN_FIRST_BLOCK));
+    if (r != 0)
+    {
+        Deselect();
+        return SCREEN_ERROR;
+    }
+    for (i=0; i<SCREEN_BLOCKS; i++)
+    {
+        r = SD_wait_for_block();
+        if (r != 0xfe)
+        {
+            break;
+        }
+        SD_skip_block();
+    }
+    if ((SD_stop_transmission() != SDCARD_OK) || (r != 0xfe))
+    {
+        return SCREEN_ERROR;
+    }
+    screenSpan = Millis() - start;
+
+    if ((screenLatency > SCREEN_MAX_LATENCY) || (screenSpan > SCREEN_MAX_SPAN))
+    {
+        return SCREEN_SLOW;
+    }
+    return SCREEN_PASS;
+}
+#endif
+
+
+
+#ifdef FINGERPRINT
+/*
+ * FingerprintCard()
+ * Streams the golden image span from the card with a single CMD18, hashing
+ * each byte as it is clocked in, and compares the CRC32 with the golden
+ * digest. The digest and the time taken are kept in fingerprint. Returns
+ * FP_MATCH, FP_MISMATCH or FP_ERROR.
+ */
+static uint8_t FingerprintCard(void)
+{
+    Golden      golden;
+    uint32_t    crc;
+    uint16_t    start;
+    uint16_t    i;
+    uint16_t    j;
+    uint8_t     r;
+
+    eeprom_read_block(&golden, &eeGolden, sizeof(golden));
+    if (golden.first == FP_UNSET)
+    {
+        return FP_MISMATCH;         // nothing to compare with, never lock
+    }
+
+    start = Millis();
+    crc = CRC32_INIT;
+    r = SD_send_command(SD_READ_MULTI_BLK, BlockAddress(golden.first));
+    if (r != 0)
+    {
+        Deselect();
+        return FP_ERROR;
+    }
+    r = 0xfe;
+    for (i=0; (i<golden.blocks) && (r == 0xfe); i++)
+    {
+        r = SD_wait_for_block();
+        if (r == 0xfe)
+        {
+            for (j=0; j<SD_BLOCK_LEN; j++)
+            {
+                crc = Crc32Byte(crc, Xchg(0xff));
+            }
+            Xchg(0xff);             // burn the CRC
+            Xchg(0xff);
+        }
+    }
+    if ((SD_stop_transmission() != SDCARD_OK) || (r != 0xfe))
+    {
+        return FP_ERROR;
+    }
+    fingerprint.digest = crc ^ CRC32_INIT;
+    fingerprint.span = Millis() - start;
+
+    if (fingerprint.digest != golden.digest)
+    {
+        return FP_MISMATCH;
+    }
+    return FP_MATCH;
+}
+
+
+
+/*
+ * Crc32Byte(crc, data)
+ * Folds a byte into a running CRC32, a nibble at a time. Its cost adds to
+ * that of reading each byte: fingerprint.span measures both together, so
+ * check it there on the target before raising the span.
+ */
+static uint32_t Crc32Byte(uint32_t crc, uint8_t data)
+{
+    crc ^= data;
+    crc = pgm_read_dword(&crc32Table[crc & 0x0f]) ^ (crc >> 4);
+    crc = pgm_read_dword(&crc32Table[crc & 0x0f]) ^ (crc >> 4);
+    return crc;
+}
+#endif
+
+
+
+#ifdef ENDURANCE
+/*
+ * Qualify()
+ * Toggles the card ENDURANCE_CYCLES times, timing the CSD write busy time
+ * and the verify of each toggle into the endurance histograms. A failed
+ * toggle is rolled back and counted, and the run ends early if the card
+ * is lost or the supply sags. The card is left as it was found, the
+ * results are saved to EEPROM, and the LED shows the verdict.
+ */
+static void Qualify(void)
+{
+    uint8_t r;
+    uint8_t wasLocked;
+
+    memset(&endurance, 0, sizeof(endurance));
+    wasLocked = CardIsLocked();
+    while (cardReady && (endurance.cycles < ENDURANCE_CYCLES))
+    {
+        r = ToggleState();
+        if (r == SDCARD_LOWVCC)     // not the card's fault, and no use going on
+        {
+            break;
+        }
+        endurance.cycles++;
+        if (r != SDCARD_OK)
+        {
+            endurance.failures++;
+            if (CommitCSD(csdOriginal) != SDCARD_OK)
+            {
+                ReadState();
+            }
+            continue;
+        }
+
+        endurance.busy[HistBucket(busyTicks)]++;
+        endurance.verify[HistBucket(verifyTicks)]++;
+        if (busyTicks > endurance.worstBusy)
+        {
+            endurance.worstBusy = busyTicks;
+        }
+        if (verifyTicks > endurance.worstVerify)
+        {
+            endurance.worstVerify = verifyTicks;
+        }
+    }
+    if (cardReady && (CardIsLocked() != wasLocked))
+    {
+        ToggleState();              // put it back, not part of the run
+    }
+
+#ifdef AUDIT_LOG
+    AuditWait();                    // the EEPROM ISR must not move EEAR under us
+#endif
+    eeprom_update_block(&endurance, &eeEndurance, sizeof(endurance));
+
+    if ((endurance.failures != 0) || (endurance.cycles < ENDURANCE_CYCLES))
+    {
+        BlinkLED(PATTERN_WERROR);   // CSD writes failed, or the run was cut short
+        BlinkLED(PATTERN_WERROR);
+        BlinkLED(PATTERN_WERROR);
+    }
+    else if ((endurance.worstBusy > (uint32_t)ENDURANCE_MAX_BUSY * TICKS_PER_MS)
+          || (endurance.worstVerify > (uint32_t)ENDURANCE_MAX_VERIFY * TICKS_PER_MS))
+    {
+        BlinkLED(PATTERN_SLOWCARD); // tail latency over the limits
+        BlinkLED(PATTERN_SLOWCARD);
+        BlinkLED(PATTERN_SLOWCARD);
+    }
+    else
+    {
+        BlinkLED(PATTERN_QUALIFIED);
+    }
+}
+
+
+
+/*
+ * HistBucket(ticks)
+ * Returns the log2 histogram bucket of a time: the number of significant
+ * bits in ticks, capped at the last bucket.
+ */
+static uint8_t HistBucket(uint32_t ticks)
+{
+    uint8_t bucket;
+
+    bucket = 0;
+    while ((ticks != 0) && (bucket < HIST_BUCKETS - 1))
+    {
+        ticks >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+#endif
+
+
+
+#ifdef CARD_POLICY
+/*
+ * CardWantsLock()
+ * Looks for the marker file in the root directory of the first partition,
+ * returns TRUE if the card carries it. Cards without a partition table,
+ * or with anything other than FAT12/16/32 or exFAT on 512-byte sectors,
+ * never do.
+ */
+static uint8_t CardWantsLock(void)
+{
+    MbrFields   mbr;
+    BootFields  boot;
+    uint32_t    root;
+    uint16_t    blocks;
+    uint8_t     exfat;
+    uint8_t     found;
+
+    INSTR_PHASE_BEGIN(PHASE_POLICY);
+    found = FALSE;
+    if ((ReadFields(0, mbrFields, sizeof(mbrFields) / sizeof(Field), &mbr) == SDCARD_OK)
+        && (mbr.signature == BOOT_SIGNATURE) && (mbr.start != 0)
+        && (ReadFields(mbr.start, bootFields, sizeof(bootFields) / sizeof(Field), &boot) == SDCARD_OK)
+        && (boot.signature == BOOT_SIGNATURE))
+    {
+        root = 0;
+        blocks = 0;
+        exfat = (memcmp_P(boot.name, PSTR("EXFAT"), sizeof(boot.name)) == 0);
+        if (exfat)
+        {
+            if ((boot.bytesPerSectorShift == 9) && (boot.sectorsPerClusterShift < 16))
+            {
+                root = mbr.start + boot.heapOffset
+                     + ((boot.rootClusterEx - 2) << boot.sectorsPerClusterShift);
+                blocks = 1 << boot.sectorsPerClusterShift;  // first cluster only
+            }
+        }
+        else if ((boot.bytesPerSector == SD_BLOCK_LEN) && (boot.sectorsPerCluster != 0))
+        {
+            root = mbr.start + boot.reservedSectors
+                 + (uint32_t)boot.fats * (boot.fatSize16 ? boot.fatSize16 : boot.fatSize32);
+            if (boot.rootEntries != 0)      // FAT12/16: fixed root directory after the FATs
+            {
+                blocks = (boot.rootEntries + (SD_BLOCK_LEN / DIR_ENTRY_LEN) - 1) / (SD_BLOCK_LEN / DIR_ENTRY_LEN);
+            }
+            else                            // FAT32: first cluster of the root directory
+            {
+                root += (boot.rootCluster - 2) * boot.sectorsPerCluster;
+                blocks = boot.sectorsPerCluster;
+            }
+        }
+        if (blocks > POLICY_MAX_BLOCKS)
+        {
+            blocks = POLICY_MAX_BLOCKS;
+        }
+        found = ScanDirectory(root, blocks, exfat);
+    }
+    INSTR_PHASE_END(PHASE_POLICY);
+    return found;
+}
+
+
+
+/*
+ * ScanDirectory(block, blocks, exfat)
+ * Streams up to blocks directory blocks starting at block, matching each
+ * entry against the marker name as its bytes go by. Stops at the end of
+ * the directory, returns TRUE if a file (not a directory or label) named
+ * POLICY_NAME, with any extension, was found. FAT entries are matched on
+ * their 8.3 name, exFAT entry sets on their name, case-insensitively.
+ */
+static uint8_t ScanDirectory(uint32_t block, uint16_t blocks, uint8_t exfat)
+{
+    uint16_t    i;
+    uint8_t     data;
+    uint8_t     pos;
+    uint8_t     expected;
+    uint8_t     type;
+    uint8_t     match;
+    uint8_t     nameLen;
+    uint8_t     nameByte;
+    uint8_t     found;
+    uint8_t     end;
+
+    type = 0;
+    match = FALSE;
+    nameLen = 0;
+    nameByte = 0;
+    found = FALSE;
+    end = FALSE;
+    while ((blocks-- != 0) && !found && !end)
+    {
+        if (SD_start_block_read(block++) != SDCARD_OK)
+        {
+            return FALSE;
+        }
+        for (i=0; i<SD_BLOCK_LEN; i++)  // the whole block is clocked out, match or not
+        {
+            data = Xchg(0xff);
+            pos = i & (DIR_ENTRY_LEN - 1);
+            if (found || end)
+            {
+                continue;
+            }
+            if (pos == 0)
+            {
+                type = data;
+                end = (data == 0);          // unused entry, none follow
+            }
+
+            if (!exfat)                     // FAT: 8-byte name padded with spaces
+            {
+                if (pos == 0)
+                {
+                    match = TRUE;
+                }
+                if (pos < 8)
+                {
+                    expected = (pos < POLICY_NAME_LEN) ? pgm_read_byte(&policyName[pos]) : ' ';
+                    if (data != expected)
+                    {
+                        match = FALSE;
+                    }
+                }
+                else if (pos == 11)
+                {
+                    found = match && !(data & (FAT_ATTR_VOLUME | FAT_ATTR_DIR));
+                }
+            }
+            else if ((type == EXFAT_FILE) && (pos == 4))
+            {
+                match = !(data & EXFAT_ATTR_DIR);
+            }
+            else if ((type == EXFAT_STREAM) && (pos == 3))
+            {
+                nameLen = data;
+                nameByte = 0;
+                if (nameLen < POLICY_NAME_LEN)
+                {
+                    match = FALSE;
+                }
+            }
+            else if ((type == EXFAT_NAME) && (pos >= 2) && match)   // UTF-16LE
+            {
+                if (nameByte & 1)
+                {
+                    expected = 0;
+                }
+                else
+                {
+                    if ((data >= 'a') && (data <= 'z'))
+                    {
+                        data -= 'a' - 'A';
+                    }
+                    expected = ((nameByte >> 1) < POLICY_NAME_LEN) ? pgm_read_byte(&policyName[nameByte >> 1]) : '.';
+                }
+                if (data != expected)
+                {
+                    match = FALSE;
+                }
+                nameByte++;
+                if (nameByte == 2 * ((nameLen > POLICY_NAME_LEN) ? POLICY_NAME_LEN + 1 : POLICY_NAME_LEN))
+                {
+                    found = match;
+                }
+            }
+        }
+        SD_end_block_read();
+    }
+    return found;
+}
+
+
+
+/*
+ * ReadFields(block, fields, count, out)
+ * Reads a block and copies the count fields listed in fields[] (in
+ * PROGMEM, in increasing offset order) one after another into out,
+ * discarding the rest of the data as it arrives.
+ */
+static uint8_t ReadFields(uint32_t block, const Field *fields, uint8_t count, void *out)
+{
+    uint8_t     *p;
+    uint16_t    i;
+    uint16_t    offset;
+    uint8_t     len;
+    uint8_t     data;
+
+    if (SD_start_block_read(block) != SDCARD_OK)
+    {
+        return SDCARD_RWFAIL;
+    }
+    p = (uint8_t *)out;
+    offset = pgm_read_word(&fields->offset);
+    len = pgm_read_byte(&fields->len);
+    for (i=0; i<SD_BLOCK_LEN; i++)
+    {
+        data = Xchg(0xff);
+        if ((count != 0) && (i >= offset))
+        {
+            *p++ = data;
+            if ((--len == 0) && (--count != 0))
+            {
+                fields++;
+                offset = pgm_read_word(&fields->offset);
+                len = pgm_read_byte(&fields->len);
+            }
+        }
+    }
+    SD_end_block_read();
+    return SDCARD_OK;
+}
+
+
+
+/*
+ * SD_start_block_read(block)
+ * Sends CMD17 for block and waits for its data token. On success the card
+ * is left selected with the data coming next.
+ */
+static uint8_t SD_start_block_read(uint32_t block)
+{
+    uint8_t r;
+
+    r = SD_send_command(SD_READ_BLK, BlockAddress(block));
+    if (r == 0)
+    {
+        r = SD_wait_for_block();
+    }
+    if (r != 0xfe)
+    {
+        Deselect();
+        return SDCARD_RWFAIL;
+    }
+    return SDCARD_OK;
+}
+
+
+
+/*
+ * SD_end_block_read()
+ * Burns the CRC after the data of a block and releases the card.
+ */
+static void SD_end_block_read(void)
+{
+    Xchg(0xff);
+    Xchg(0xff);
+    Deselect();
+}
+#endif
+
+
+
+/*
+ * LoadParams()
+ * Loads the runtime parameters from EEPROM, falling back to the defaults
+ * if the block was never written, is from another firmware version, or
+ * holds values out of range.
+ */
+static void LoadParams(void)
+{
+    eeprom_read_block(&params, &eeParams, sizeof(params));
+    if ((params.version != PARAMS_VERSION) || (ParamsSum() != 0xff) || !ParamsValid(&params))
+    {
+        DefaultParams();
+    }
+}
+
+
+
+/*
+ * SaveParams()
+ * Stores the runtime parameters in EEPROM, only rewriting changed bytes.
+ */
+static void SaveParams(void)
+{
+#ifdef AUDIT_LOG
+    AuditWait();            // the EEPROM ISR must not move EEAR under us
+#endif
+    params.version = PARAMS_VERSION;
+    params.check = 0;
+    params.check = 0xff - ParamsSum();
+    eeprom_update_block(&params, &eeParams, sizeof(params));
+}
+
+
+
+/*
+ * DefaultParams()
+ * Sets the runtime parameters to the built-in defaults.
+ */
+static void DefaultParams(void)
+{
+    memcpy_P(&params, &defaultParams, sizeof(params));
+}
+
+
+
+/*
+ * ParamsSum()
+ * Returns the 8-bit sum of all bytes of the runtime parameters.
+ */
+static uint8_t ParamsSum(void)
+{
+    uint8_t i;
+    uint8_t sum = 0;
+
+    for (i=0; i<sizeof(params); i++)
+    {
+        sum += ((uint8_t *)&params)[i];
+    }
+    return sum;
+}
+
+
+
+/*
+ * ParamsValid(p)
+ * Returns TRUE if the runtime parameters in p are all usable: no zero
+ * debounce or LED step, and no data wait or timeout too short for a card
+ * within the SD spec.
+ */
+static uint8_t ParamsValid(const Params *p)
+{
+    return (p->debounceCount != 0) && (p->debounceInterval != 0) && (p->blinkStep != 0)
+        && (p->dataWait >= PARAM_DATA_WAIT_MIN)
+        && (p->initTimeout >= PARAM_INIT_TIMEOUT_MIN)
+        && (p->writeTimeout >= PARAM_WRITE_TIMEOUT_MIN);
+}
+
+
+
+#ifdef AUDIT_LOG
+/*
+ * AuditInit()
+ * Counts this boot, and finds the oldest audit log record: the first one
+ * out of sequence after the last record written.
+ */
+static void AuditInit(void)
+{
+    uint8_t i;
+    uint8_t seq;
+    uint8_t prev;
+
+    boots = eeprom_read_word(&eeBoots) + 1;
+    eeprom_update_word(&eeBoots, boots);
+
+    prev = eeprom_read_byte(&eeAudit[0].seq);
+    for (i=1; i<AUDIT_LEN; i++)
+    {
+        seq = eeprom_read_byte(&eeAudit[i].seq);
+        if (seq != (uint8_t)(prev + 1))
+        {
+            break;
+        }
+        prev = seq;
+    }
+    auditHead = (i == AUDIT_LEN) ? 0 : i;
+    auditRec.seq = prev;    // AuditBegin() numbers the next record
+}
+
+
+
+/*
+ * AuditBegin(action)
+ * Starts a record of an action on the inserted card, while its CID is
+ * still known. Waits for the previous record to be written first.
+ */
+static void AuditBegin(uint8_t action)
+{
+    uint8_t i;
+    uint16_t hash = 0xffff;
+
+    AuditWait();
+    for (i=0; i<sizeof(regs.cid); i++)
+    {
+        hash = _crc_ccitt_update(hash, regs.cid[i]);
+    }
+    auditRec.seq++;
+    auditRec.event = action;
+    auditRec.boot = boots;
+    auditRec.cidHash = hash;
+}
+
+
+
+/*
+ * AuditEnd(result)
+ * Completes the record started by AuditBegin() with the result of the
+ * action, and leaves it to the EEPROM ready ISR to write. The record is
+ * written back to front so its number goes last: if power fails halfway,
+ * the slot keeps the old number and AuditInit() takes it as the oldest.
+ */
+static void AuditEnd(uint8_t result)
+{
+    auditRec.event |= result;
+    auditAddr = (uint8_t *)&eeAudit[auditHead + 1];
+    if (++auditHead == AUDIT_LEN)
+    {
+        auditHead = 0;
+    }
+    auditLeft = sizeof(auditRec);
+    EECR |= (1<<EERIE);     // the ISR fires as soon as the EEPROM is ready
+}
+
+
+
+/*
+ * AuditWait()
+ * Waits until the EEPROM ready ISR has written the last record.
+ */
+static void AuditWait(void)
+{
+    while (auditLeft)
+    {
+        ;
+    }
+}
+
+
+
+ISR(EE_RDY_vect)
+{
+    uint8_t left;
+
+    left = --auditLeft;
+    EEAR = (uintptr_t)--auditAddr;
+    EEDR = ((uint8_t *)&auditRec)[left];
+    EECR = (left ? (1<<EERIE) : 0) | (1<<EEMPE);    // erase and write, stop after the last byte
+    EECR |= (1<<EEPE);
+}
+#endif
+
+
+
+/*
+ * StartClock()
+ * Starts Timer1 as a free-running millisecond clock.
+ */
+static void StartClock(void)
+{
+    OCR1C = CLOCK_TOP;          // clear the counter every 1 ms...
+    OCR1A = CLOCK_TOP;          // ...and raise compare match A at the same point
+    TCCR1 = (1<<CTC1) | (1<<CS12) | (1<<CS11) | (1<<CS10);  // CTC mode, CK/64
+    TIMSK |= (1<<OCIE1A);
+    sei();
+}
+
+
+
+/*
+ * Millis()
+ * Returns the milliseconds elapsed since the clock was started (wraps around).
+ * This is the only time source: all delays and card timeouts are measured
+ * against it, so they share one clock and can be replaced together.
+ */
+static uint16_t Millis(void)
+{
+    uint16_t t;
+
+    cli();              // 16-bit read must not be torn by the ISR
+    t = clockTicks;
+    sei();
+    return t;
+}
+
+
+
+#ifdef ENDURANCE
+/*
+ * TakeStamp(stamp)
+ * Reads the clock down to the timer count. If the counter has just been
+ * cleared but the ISR has not run yet, the ms it starts is counted here.
+ */
+static void TakeStamp(Stamp *stamp)
+{
+    cli();
+    stamp->tick = TCNT1;
+    stamp->ms = clockTicks;
+    if ((TIFR & (1<<OCF1A)) && (stamp->tick < TICKS_PER_MS / 2))
+    {
+        stamp->ms++;
+    }
+    sei();
+}
+
+
+
+/*
+ * TicksSince(stamp)
+ * Returns the clock ticks (8 us) elapsed since stamp, up to 65 s.
+ */
+static uint32_t TicksSince(const Stamp *stamp)
+{
+    Stamp now;
+
+    TakeStamp(&now);
+    return (uint32_t)(uint16_t)(now.ms - stamp->ms) * TICKS_PER_MS + now.tick - stamp->tick;
+}
+#endif
+
+
+
+/*
+ * Delay(ms)
+ * Waits for the specified number of milliseconds, sleeping in idle mode
+ * between clock ticks instead of spinning.
+ */
+static void Delay(uint16_t ms)
+{
+    uint16_t start;
+
+    start = Millis();
+    while ((uint16_t)(Millis() - start) < ms)
+    {
+        sleep_mode();   // woken up by the next clock tick
+    }
+}
+
+
+
+/*
+ * SleepUntilPress()
+ * Powers down when there is nothing to do: card read, LED off, and no
+ * deadline, event, switch activity or transfer pending. The clock stops
+ * meanwhile. With the LED off the shared line can be left as an input
+ * with its pull-up, so a press pulls it low and the pin change wakes the
+ * MCU. With the LED on the line has to drive it, so presses are found by
+ * the clock ISR sampling the line in short windows, as usual.
+ * Returns TRUE if it slept and the switch woke it, FALSE if it did not
+ * sleep or something else (e.g. the control interface) woke it.
+ */
+static uint8_t SleepUntilPress(void)
+{
+    cli();
+    if (!cardReady || ledOn || deadlineArmed || (eventHead != eventTail) ||
+        (swStable == SW_PRESSED) || (swCount != 0)
+#ifdef AUDIT_LOG
+        || auditLeft                // the EEPROM ready interrupt needs the clock
+#endif
+#ifdef TWI_SLAVE
+        || (USICR & (1<<USIOIE))    // between a start and a stop
+#endif
+        )
+    {
+        sei();
+        return FALSE;
+    }
+
+    LEDSW_AS_SW;            // the line is high with the LED off, so the pull-up is on
+    PCMSK = (1<<LEDSW_BIT);
+    GIFR = (1<<PCIF);       // forget changes made by the switch sampling
+    GIMSK |= (1<<PCIE);
+    pinWoke = FALSE;
+    set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+    sleep_enable();
+#ifdef sleep_bod_disable
+    sleep_bod_disable();
+#endif
+    sei();                  // takes effect after the next instruction, so no wake up is lost
+    sleep_cpu();
+    sleep_disable();
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    GIMSK &= ~(1<<PCIE);
+    LEDSW_AS_LED;
+    return pinWoke;
+}
+
+
+
+#if INSTRUMENT >= 1
+/*
+ * PhaseBegin(phase)
+ * Marks the start of a phase.
+ */
+static void PhaseBegin(uint8_t phase)
+{
+    phaseStart[phase] = Millis();
+    phaseOpen |= (1<<phase);
+}
+
+
+
+/*
+ * PhaseEnd(phase)
+ * Records the time taken by a phase, if it is the worst seen so far.
+ * Does nothing if the phase was not begun, e.g. a press without a wake.
+ */
+static void PhaseEnd(uint8_t phase)
+{
+    uint16_t elapsed;
+
+    if (!(phaseOpen & (1<<phase)))
+    {
+        return;
+    }
+    phaseOpen &= ~(1<<phase);
+    elapsed = Millis() - phaseStart[phase];
+    if (elapsed > phaseWorst[phase])
+    {
+        phaseWorst[phase] = elapsed;
+    }
+}
+
+
+
+/*
+ * PaintStack()
+ * Fills all RAM above the static data with STACK_PAINT, before the C
+ * runtime sets up anything. Runs from .init1, so it cannot rely on r1
+ * being zero nor use the stack, hence the assembler.
+ */
+static void PaintStack(void)
+{
+    __asm__ __volatile__ (
+        "    ldi r30, lo8(_end)     \n"
+        "    ldi r31, hi8(_end)     \n"
+        "    ldi r24, %0            \n"
+        "    ldi r25, hi8(__stack)  \n"
+        "    rjmp 2f                \n"
+        "1:  st Z+, r24             \n"
+        "2:  cpi r30, lo8(__stack)  \n"
+        "    cpc r31, r25           \n"
+        "    brlo 1b                \n"
+        "    breq 1b                \n"
+        :: "n" (STACK_PAINT));
+}
+
+
+
+/*
+ * CheckStack()
+ * Counts the painted bytes still untouched above the static data and
+ * records the least seen so far, the stack headroom left at worst.
+ */
+static void CheckStack(void)
+{
+    const uint8_t *p;
+    uint16_t unused = 0;
+
+    for (p = &_end; (p <= &__stack) && (*p == STACK_PAINT); p++)
+    {
+        unused++;
+    }
+    if (unused < stackFree)
+    {
+        stackFree = unused;
+    }
+}
+#endif
+
+
+
+#if INSTRUMENT >= 2
+/*
+ * TraceSelect()
+ * Opens a transcript entry when CS goes low, overwriting the oldest one.
+ */
+static void TraceSelect(void)
+{
+    if (traceOpen)
+    {
+        return;     // already selected
+    }
+    traceOpen = &trace[traceNext];
+    traceOpen->start = Millis();
+    traceOpen->bytes = 0;
+    traceOpen->command = 0;
+    traceOpen->response = 0xff;
+}
+
+
+
+/*
+ * TraceDeselect()
+ * Closes the open transcript entry when CS goes high.
+ */
+static void TraceDeselect(void)
+{
+    uint16_t elapsed;
+
+    if (!traceOpen)
+    {
+        return;     // already deselected
+    }
+    elapsed = Millis() - traceOpen->start;
+    traceOpen->time = (elapsed > 255) ? 255 : elapsed;
+    traceOpen = NULL;
+    traceNext = (traceNext + 1) & TRACE_MASK;
+}
+
+
+
+/*
+ * TraceByte()
+ * Counts a byte exchanged in the open transaction.
+ */
+static void TraceByte(void)
+{
+    if (traceOpen)
+    {
+        traceOpen->bytes++;
+    }
+}
+
+
+
+/*
+ * TraceCommand(command, response)
+ * Records the first command sent in the open transaction and its response.
+ */
+static void TraceCommand(uint8_t command, uint8_t response)
+{
+    if (traceOpen && !traceOpen->command)
+    {
+        traceOpen->command = command;
+        traceOpen->response = response;
+    }
+}
+#endif
+
+
+
+/*
+ * SetDeadline(ms)
+ * Arms a deadline, EV_DEADLINE will be pushed once ms have elapsed.
+ */
+static void SetDeadline(uint16_t ms)
+{
+    cli();
+    deadline = clockTicks + ms;
+    deadlineArmed = TRUE;
+    sei();
+}
+
+
+
+/*
+ * PushEvent(event)
+ * Adds an event to the queue. Only called from interrupt handlers.
+ * The event is dropped if the queue is full.
+ */
+static void PushEvent(uint8_t event)
+{
+    uint8_t head;
+
+    head = eventHead;
+    if ((uint8_t)(head - eventTail) >= EVENT_QUEUE_LEN)
+    {
+        return;     // full
+    }
+    eventQueue[head & EVENT_QUEUE_MASK] = event;
+    eventHead = head + 1;   // publish only after the slot is written
+}
+
+
+
+/*
+ * PopEvent()
+ * Takes the oldest event from the queue. Only called from the main loop.
+ * Returns EV_NONE if the queue is empty.
+ */
+static uint8_t PopEvent(void)
+{
+    uint8_t tail;
+    uint8_t event;
+
+    tail = eventTail;
+    if (tail == eventHead)
+    {
+        return EV_NONE;
+    }
+    event = eventQueue[tail & EVENT_QUEUE_MASK];
+    eventTail = tail + 1;   // release the slot only after it is read
+    INSTR_COUNT(CNT_EVENTS);
+    return event;
+}
+
+
+
+ISR(PCINT0_vect)
+{
+    swTimer = params.debounceInterval - 1;  // wake up: sample the switch on the next tick
+    pinWoke = TRUE;
+}
+
+
+
+ISR(TIMER1_COMPA_vect)
+{
+    clockTicks++;
+
+    if (deadlineArmed && (clockTicks == deadline))
+    {
+        deadlineArmed = FALSE;
+        PushEvent(EV_DEADLINE);
+    }
+    SampleSwitch();
+}
+
+
+
+/*
+ * AddByteToCRC(crc, b)
+ * Adds a byte to a running CRC7, returns the updated CRC7.
+ */
+static uint8_t AddByteToCRC(uint8_t crc, uint8_t b)
+{
+    return pgm_read_byte(&crctable[(crc << 1) ^ b]);
+}
+
+
+
+/*
+ * RegisterCRC(reg)
+ * Returns the CRC7 of the first 15 bytes of a CID or CSD register,
+ * formatted as its last byte (CRC7 followed by the end bit).
+ */
+static uint8_t RegisterCRC(const uint8_t *reg)
+{
+    uint8_t i;
+    uint8_t crc = 0;
+
+    for (i=0; i<15; i++)
+    {
+        crc = AddByteToCRC(crc, reg[i]);
+    }
+    return (crc<<1) | 0x01;
 }
 
 
 
+
 /*
- * SDInit()
- * Initialize the SD card.
+ * SD_send_command(command, arg)
+ * Sends a raw command to SD card, returns the response.
+ *
+ * This routine accepts a single SD command and a 4-byte argument. It sends
+ * the command plus argument, adding the CRC7 computed over both. It then returns
+ * the one-byte response from the SD card.
+ *
+ * For advanced commands (those with a command byte having bit 7 set), this
+ * routine automatically sends the required preface command (CMD55) before
+ * sending the requested command.
+ *
+ * Upon exit, this routine returns the response byte from the SD card.
+ * Possible responses are:
+ *   0xff   No response from card; card might actually be missing
+ *   0x01   SD card returned 0x01, which is OK for most commands
+ *   0x??   other responses are command-specific
  */
-static uint8_t SDInit(void)
+static uint8_t SD_send_command(uint8_t command, uint32_t arg)
 {
-    uint16_t    i;
-    uint8_t     response;
+    uint8_t response;
+    uint8_t i;
+    uint8_t b;
+    uint8_t crc;
+
+    if (command & 0x80)     // special case, ACMD(n) is sent as CMD55 and CMDn
+    {
+        command = command & 0x7f;               // strip high bit for later
+        response = SD_send_command(CMD55, 0);   // send first part (recursion)
+        if (response > 1)
+        {
+            return response;
+        }
+    }
+
+    if (command != SD_STOP_TRANS)   // CMD12 is sent in the middle of a transfer
+    {
+        Deselect();
+        Xchg(0xff);
+        Select();   // enable CS
+        Xchg(0xff);
+    }
+
+    INSTR_COUNT(CNT_COMMANDS);
+    command |= 0x40;            // command always has bit 6 set!
+    Xchg(command);
+    crc = AddByteToCRC(0, command);
+    for (i=0; i<4; i++)         // send data, starting with top byte
+    {
+        b = (uint8_t)(arg>>24);
+        Xchg(b);
+        crc = AddByteToCRC(crc, b);
+        arg <<= 8;
+    }
+
+    Xchg((crc<<1) | 0x01);      // send final byte, a valid CRC7 for every command
+
+    if (command == SD_STOP_TRANS)
+    {
+        Xchg(0xff);             // discard the stuff byte following CMD12
+    }
+
+    for (i=0; i<10; i++)        // loop until timeout or response
+    {
+        response = Xchg(0xff);
+        if ((response & 0x80) == 0)
+        {
+            break;              // high bit cleared means we got a response
+        }
+    }
 
-    sdtype = SDTYPE_UNKNOWN;    // assume this fails
     /*
-     * Begin initialization by sending CMD0 and waiting until SD card
-     * responds with In Idle Mode (0x01). If the response is not 0x01
-     * within a reasonable amount of time, there is no SD card on the bus.
+     * We have issued the command but the SD card is still selected. We
+     * only deselect the card if the command we just sent is NOT a command
+     * that requires additional data exchange, such as reading or writing
+     * a block.
      */
-    Deselect();             // always make sure card was not selected
-    for (i=0; i<10; i++)    // send several clocks while card power stabilizes
+    if ((command != SD_READ_BLK) &&
+        (command != SD_READ_MULTI_BLK) &&
+        (command != SD_STOP_TRANS) &&
+        (command != SD_READ_OCR) &&
+        (command != SD_SEND_CSD) &&
+        (command != SD_SEND_STATUS) &&
+        (command != SD_SEND_CID) &&
+        (command != SD_SEND_IF_COND) &&
+        (command != SD_LOCK_UNLOCK) &&
+        (command != SD_PROGRAM_CSD))
+    {
+        Deselect(); // all done
+        Xchg(0xff); // close with eight more clocks
+    }
+
+    INSTR_TRACE(command, response);
+    return response;    // let the caller sort it out
+}
+
+
+static uint8_t SD_wait_for_data(void)
+{
+    uint8_t i;
+    uint8_t r = 0xff;
+
+    for (i=0; i<params.dataWait; i++)
+    {
+        r = Xchg(0xff);
+        if (r != 0xff)
+        {
+            break;
+        }
+    }
+    return r;
+}
+
+
+
+#if defined(READ_SCREENING) || defined(CARD_POLICY) || defined(FINGERPRINT)
+/*
+ * BlockAddress(block)
+ * Returns the read command argument for block: standard-capacity cards
+ * take a byte address, SDHC cards a block number.
+ */
+static uint32_t BlockAddress(uint32_t block)
+{
+    if (sdtype != SDTYPE_SDHC)
+    {
+        block *= SD_BLOCK_LEN;
+    }
+    return block;
+}
+
+
+
+/*
+ * SD_wait_for_block()
+ * Waits for the start of a data block after a read command, returns the
+ * token received (0xfe on success), or 0xff if SD_READ_TIMEOUT expired.
+ */
+static uint8_t SD_wait_for_block(void)
+{
+    uint16_t start;
+    uint8_t r;
+
+    start = Millis();
+    do
+    {
+        r = Xchg(0xff);
+        if (r != 0xff)
+        {
+            break;
+        }
+    } while ((uint16_t)(Millis() - start) < SD_READ_TIMEOUT);
+    return r;
+}
+#endif
+
+
+
+#if defined(READ_SCREENING) || defined(FINGERPRINT)
+/*
+ * SD_stop_transmission()
+ * Ends a multiple block read with CMD12 and waits while the card is busy.
+ */
+static uint8_t SD_stop_transmission(void)
+{
+    uint16_t start;
+
+    SD_send_command(SD_STOP_TRANS, 0);
+    start = Millis();
+    while (!Xchg(0xff))     // card holds DO low while busy
+    {
+        if ((uint16_t)(Millis() - start) >= SD_READ_TIMEOUT)
+        {
+            Deselect();
+            return SDCARD_TIMEOUT;
+        }
+    }
+    Deselect();
+    Xchg(0xff);
+    return SDCARD_OK;
+}
+#endif
+
+
+
+#ifdef READ_SCREENING
+/*
+ * SD_skip_block()
+ * Clocks out a whole data block and its CRC, discarding the data.
+ */
+static void SD_skip_block(void)
+{
+    uint16_t i;
+
+    for (i=0; i<SD_BLOCK_LEN+2; i++)
+    {
+        Xchg(0xff);
+    }
+}
+#endif
+
+
+
+#ifdef TWI_SLAVE
+/*
+ * TwiAttach()
+ * Hands the shared SDA/MOSI and SCL/SCK lines to the USI as a two-wire slave,
+ * deasserting CS first so the card ignores the traffic.
+ * Does nothing if already attached.
+ */
+static void TwiAttach(void)
+{
+    if (!(PRR & (1<<PRUSI)))
+    {
+        return;
+    }
+    Deselect();                                 // the card must not see the bus traffic
+    PRR &= ~(1<<PRUSI);
+    SPI_PORT |= (1<<SDA_BIT) | (1<<SCL_BIT);    // release both lines
+    SPI_DDR  |= (1<<SCL_BIT);                   // lets the USI stretch the clock
+    SPI_DDR  &= ~(1<<SDA_BIT);
+    USI_WAIT_FOR_START;
+    USISR = (1<<USISIF) | (1<<USIOIF) | (1<<USIPF); // drop anything seen while detached
+}
+
+
+
+/*
+ * TwiDetach()
+ * Gives the shared lines back to the SPI, after letting a transfer in
+ * progress finish. Does nothing if not attached.
+ */
+static void TwiDetach(void)
+{
+    uint16_t start;
+
+    if (PRR & (1<<PRUSI))
+    {
+        return;
+    }
+    start = Millis();
+    while ((USICR & (1<<USIOIE)) && !(USISR & (1<<USIPF)) &&
+           ((uint16_t)(Millis() - start) < TWI_STOP_TIMEOUT))
+    {
+        ;   // master is between start and stop
+    }
+    USICR = 0;
+    PRR |= (1<<PRUSI);
+    SPI_DDR |= (1<<MOSI_BIT) | (1<<SCK_BIT);    // back to SPI outputs
+}
+
+
+
+/*
+ * TwiRunCommand(event)
+ * Runs a command from the master: lock (EV_LOCK), unlock (EV_UNLOCK),
+ * apply (EV_APPLY), apply and save (EV_SAVE) the staged parameters, or
+ * restore default (EV_DEFAULTS) parameters. Staged parameters out of
+ * range are dropped and the command fails.
+ * Locking a locked card (or unlocking an unlocked one) succeeds at once.
+ */
+static void TwiRunCommand(uint8_t event)
+{
+    TwiDetach();            // no EEPROM reads from the ISR while saving
+    twiFailed = FALSE;
+    if (event == EV_DEFAULTS)
+    {
+        DefaultParams();
+        SaveParams();
+        twiParams = params;
+    }
+    else if ((event == EV_SAVE) || (event == EV_APPLY))
+    {
+        if (ParamsValid(&twiParams))    // the ISR is off, the staged copy is whole
+        {
+            memcpy(&params.debounceCount, &twiParams.debounceCount, TWI_PARAMS_LEN);
+            if (event == EV_SAVE)
+            {
+                SaveParams();
+            }
+        }
+        else
+        {
+            twiFailed = TRUE;
+        }
+        twiParams = params;     // rejected values are dropped, the master reads back what is in use
+    }
+    else if (!cardReady)
+    {
+        twiFailed = TRUE;
+    }
+    else if ((event == EV_LOCK) != (CardIsLocked() != 0))
+    {
+        twiFailed = !ChangeState();
+    }
+    twiPending = FALSE;
+}
+
+
+
+/*
+ * TwiRead(reg)
+ * Returns the value of a register for the master. Called from the ISR.
+ */
+static uint8_t TwiRead(uint8_t reg)
+{
+    uint8_t value;
+
+    if (reg == TWI_REG_STATUS)
+    {
+        value = 0;
+        if (cardReady)      value |= TWI_STATUS_READY;
+        if (CardIsLocked()) value |= TWI_STATUS_LOCKED;
+        if (twiPending)     value |= TWI_STATUS_PENDING;
+        if (twiFailed)      value |= TWI_STATUS_FAILED;
+        return value;
+    }
+    if ((reg >= TWI_REG_CID) && (reg < TWI_REG_CID + 16))
+    {
+        return regs.cid[reg - TWI_REG_CID];
+    }
+    if ((reg >= TWI_REG_CSD) && (reg < TWI_REG_CSD + 16))
+    {
+        return regs.csd[reg - TWI_REG_CSD];
+    }
+    if ((reg >= TWI_REG_COUNTERS) && (reg < TWI_REG_COUNTERS + sizeof(counters)))
+    {
+        return ((uint8_t *)counters)[reg - TWI_REG_COUNTERS];
+    }
+    if ((reg >= TWI_REG_PARAMS) && (reg < TWI_REG_PARAMS + TWI_PARAMS_LEN))
+    {
+        return ((uint8_t *)&twiParams)[reg - TWI_REG_PARAMS + 1];   // version and check are internal
+    }
+#ifdef AUDIT_LOG
+    if (reg == TWI_REG_AUDIT)
+    {
+        uint16_t pos;
+
+        pos = twiAuditPos + auditHead * sizeof(AuditRecord);
+        if (pos >= sizeof(eeAudit))
+        {
+            pos -= sizeof(eeAudit);
+        }
+        if (++twiAuditPos == sizeof(eeAudit))
+        {
+            twiAuditPos = 0;
+        }
+        return eeprom_read_byte((uint8_t *)eeAudit + pos);
+    }
+#endif
+    if ((reg >= TWI_REG_RECOVERIES) && (reg < TWI_REG_RECOVERIES + sizeof(recoveries)))
+    {
+        return ((uint8_t *)recoveries)[reg - TWI_REG_RECOVERIES];
+    }
+#ifdef ENDURANCE
+    if ((reg >= TWI_REG_ENDURANCE) && (reg < TWI_REG_ENDURANCE + sizeof(endurance)))
+    {
+        return ((uint8_t *)&endurance)[reg - TWI_REG_ENDURANCE];
+    }
+#endif
+#ifdef FINGERPRINT
+    if ((reg >= TWI_REG_FINGERPRINT) && (reg < TWI_REG_FINGERPRINT + sizeof(fingerprint)))
+    {
+        return ((uint8_t *)&fingerprint)[reg - TWI_REG_FINGERPRINT];
+    }
+#endif
+#if INSTRUMENT >= 2
+    if (reg == TWI_REG_TRACE)
+    {
+        uint8_t pos;
+
+        pos = twiTracePos + traceNext * sizeof(TraceEntry);
+        if (pos >= sizeof(trace))
+        {
+            pos -= sizeof(trace);
+        }
+        if (++twiTracePos == sizeof(trace))
+        {
+            twiTracePos = 0;
+        }
+        return ((uint8_t *)trace)[pos];
+    }
+#endif
+    return 0xff;
+}
+
+
+
+/*
+ * TwiWrite(reg, value)
+ * Stores a value written by the master. Called from the ISR.
+ */
+static void TwiWrite(uint8_t reg, uint8_t value)
+{
+    if (reg == TWI_REG_COMMAND)
+    {
+        if ((value >= TWI_CMD_LOCK) && (value <= TWI_CMD_APPLY))
+        {
+            twiPending = TRUE;
+            PushEvent(value - TWI_CMD_LOCK + EV_LOCK);  // run by the main loop
+        }
+        else
+        {
+            twiFailed = TRUE;
+        }
+    }
+    else if ((reg >= TWI_REG_PARAMS) && (reg < TWI_REG_PARAMS + TWI_PARAMS_LEN))
+    {
+        ((uint8_t *)&twiParams)[reg - TWI_REG_PARAMS + 1] = value;  // staged, applied on TWI_CMD_APPLY or TWI_CMD_SAVE
+    }
+#ifdef AUDIT_LOG
+    else if (reg == TWI_REG_AUDIT)
+    {
+        twiAuditPos = 0;
+    }
+#endif
+#if INSTRUMENT >= 2
+    else if (reg == TWI_REG_TRACE)  // the card is idle while attached, nothing is open
     {
-        Xchg(0xff);
+        memset(trace, 0, sizeof(trace));
+        traceNext = 0;
+        twiTracePos = 0;
     }
+#endif
+}
 
-    for (i=0; i<10; i++)
+
+
+ISR(USI_START_vect)
+{
+    twiState = TWI_CHECK_ADDRESS;
+    SPI_DDR &= ~(1<<SDA_BIT);
+    while ((SPI_PIN & (1<<SCL_BIT)) && !(SPI_PIN & (1<<SDA_BIT)))
     {
-        response = SD_send_command(SD_GO_IDLE, 0);  // send CMD0 - go to idle state
-        if (response == 0x01)
-        {
-            break;
-        }
+        ;   // wait for SCL low to complete the start, or SDA high for a stop
     }
-    if (response != 0x01)
+    if (!(SPI_PIN & (1<<SDA_BIT)))  // start: count the address byte, hold SCL after it
     {
-        return SDCARD_NOT_DETECTED;
+        USICR = (1<<USISIE) | (1<<USIOIE) | (1<<USIWM1) | (1<<USIWM0) | (1<<USICS1);
+    }
+    else                            // stop: wait for the next start
+    {
+        USICR = (1<<USISIE) | (1<<USIWM1) | (1<<USICS1);
     }
+    USISR = (1<<USISIF) | (1<<USIOIF) | (1<<USIPF);
+}
 
-    response = SD_send_command(SD_SEND_IF_COND, 0x1aa); // check if card is SDv2 (SDHC)
-    if (response == 0x01)                               // if card is SDHC...
+
+
+ISR(USI_OVF_vect)
+{
+    switch (twiState)
     {
-        for (i=0; i<4; i++)                             // burn the 4-byte response (OCR)
+    case TWI_CHECK_ADDRESS:
+        if ((USIDR >> 1) != TWI_ADDRESS)
         {
-            Xchg(0xff);
+            USI_WAIT_FOR_START;     // not for us
+            break;
         }
-        for (i=20000; i>0; i--)
+        if (USIDR & 0x01)
         {
-            response = SD_send_command(SD_ADV_INIT, 1UL<<30);
-            if (response == 0)
-            {
-                break;
-            }
+            twiState = TWI_SEND_DATA;
         }
-        sdtype = SDTYPE_SDHC;
-    }
-    else
-    {                                               // if card is SD...
-        response = SD_send_command(SD_READ_OCR, 0);
-        if (response == 0x01)
+        else
         {
-            for (i=0; i<4; i++)                     // burn the 4-byte response (OCR)
-            {
-                Xchg(0xff);
-            }
-            for (i=20000; i>0; i--)
-            {
-                response = SD_send_command(SD_INIT, 0);
-                if (response == 0)
-                {
-                    break;
-                }
-            }
-            SD_send_command(SD_SET_BLK_LEN, 512);
-            sdtype = SDTYPE_SD;
+            twiState = TWI_REQUEST_DATA;
+            twiGotReg = FALSE;      // first byte written is the register number
+        }
+        USI_SEND_ACK;
+        break;
+
+    case TWI_CHECK_ACK:
+        if (USIDR)                  // master NACKed, transfer is over
+        {
+            USI_WAIT_FOR_START;
+            break;
+        }
+        // fall through - master wants another byte
+    case TWI_SEND_DATA:
+        USIDR = TwiRead(twiReg);
+        if ((twiReg != TWI_REG_AUDIT) && (twiReg != TWI_REG_TRACE)) // logs are read through one register
+        {
+            twiReg++;
         }
+        twiState = TWI_REQUEST_ACK;
+        USI_SEND_DATA;
+        break;
+
+    case TWI_REQUEST_ACK:
+        twiState = TWI_CHECK_ACK;
+        USI_READ_ACK;
+        break;
+
+    case TWI_REQUEST_DATA:
+        twiState = TWI_GET_DATA;
+        USI_READ_DATA;
+        break;
+
+    case TWI_GET_DATA:
+        if (twiGotReg)
+        {
+            TwiWrite(twiReg++, USIDR);
+        }
+        else
+        {
+            twiReg = USIDR;
+            twiGotReg = TRUE;
+        }
+        twiState = TWI_REQUEST_DATA;
+        USI_SEND_ACK;
+        break;
     }
+}
+#endif
 
-    Xchg(0xff); // send 8 final clocks
 
-    /*
-     * At this point, the SD card has completed initialization. The calling routine
-     * could now increase the SPI clock rate for the SD card to the maximum allowed by
-     * the SD card (typically, 20 MHz).
-     */
 
-    return SDCARD_OK;   // if no power routine or turning off the card, call it good
+#ifdef UPDATER
+/*
+ * BootEntry()
+ * Fixed entry jumps of the updater, at UPDATER_START, the same in every
+ * build so an application flashed from an image finds the updater it was
+ * flashed by. UPDATER_RESUME is the reset entry, page 0 only jumps there
+ * while an update is in progress: registers may hold anything after a
+ * reset, so clear what the compiler relies on, then finish the update.
+ * UPDATER_UPDATE is BootUpdate(), an ordinary call from the application.
+ */
+static void BootEntry(void)
+{
+    __asm__ __volatile__ (
+        "    rjmp 1f                        \n"    // UPDATER_RESUME
+        "    rjmp %x0                       \n"    // UPDATER_UPDATE
+        "1:  cli                            \n"
+        "    clr __zero_reg__               \n"
+        "    out __SREG__, __zero_reg__     \n"
+        "    rjmp %x1                       \n"
+        :: "i" (BootUpdate), "i" (BootResume));
 }
 
 
 
 /*
- * ReadCSD()
- * Reads the CSD from the card, storing it in csd[].
+ * BootResume()
+ * Keeps trying to finish an interrupted update, blinking slowly while
+ * there is no valid image to finish it with.
  */
-static uint8_t ReadCSD(void)
+static void BootResume(void)
 {
-    uint8_t i;
-    uint8_t response;
-
-    for (i=0; i<16; i++)
+    while (1)
     {
-        csd[i] = 0;
+        BootUpdate();
+        LEDSW_PORT ^= LEDSW_MASK;
+        _delay_ms(500);
     }
+}
 
-    response = SD_send_command(SD_SEND_CSD, 0);
-    response = SD_wait_for_data();
-    if (response != 0xfe)
+
+
+/*
+ * BootUpdate()
+ * Checks the image on the card, flashes it and starts it. Returns only
+ * if there is no valid image, before touching the flash. Once writing
+ * has begun, keeps trying until the whole image is in and verified.
+ */
+static void BootUpdate(void)
+{
+    uint16_t length;
+
+    if (!BootCheck(&length))
     {
-        return SDCARD_RWFAIL;
+        return;
     }
-
-    for (i=0; i<16; i++)
+    while (!BootFlash(length))
     {
-        csd[i] = Xchg(0xff);
+        while (!BootCheck(&length))
+        {
+            _delay_ms(500);
+        }
     }
-
-    Xchg(0xff); // burn the CRC
-    return SDCARD_OK;
+    ((void (*)(void))0)();  // start the new firmware from its reset vector
 }
 
 
 
 /*
- * WriteCSD()
- * Writes csd[] to the CSD on the card.
+ * BootCheck(length)
+ * Initializes the card and reads the image header. Returns TRUE and the
+ * image length if the header is valid and the image matches its CRC.
  */
-static uint8_t WriteCSD(void)
+static uint8_t BootCheck(uint16_t *length)
 {
-    uint8_t     response;
-    uint8_t     tcrc;
-    uint16_t    i;
-
-    response = SD_send_command(SD_PROGRAM_CSD, 0);
-    if (response != 0)
+    BootStream  s;
+    uint8_t     shift;
+    uint8_t     i;
+    uint16_t    n;
+    uint16_t    crc = 0xffff;
+    uint32_t    magic = 0;
+    uint16_t    check;
+
+    shift = BootInit();
+    if (shift == UPDATE_NO_CARD)
     {
-        return SDCARD_RWFAIL;
+        return FALSE;
     }
 
-    Xchg(0xfe); // send data token marking start of data block
+    BootOpen(&s, UPDATE_BLOCK, shift);
+    for (i=0; i<32; i+=8)
+    {
+        magic |= (uint32_t)BootByte(&s) << i;
+    }
+    n = BootByte(&s);
+    n |= BootByte(&s) << 8;
+    check = BootByte(&s);
+    check |= BootByte(&s) << 8;
+    BootClose(&s);
+    if (s.failed || (magic != UPDATE_MAGIC) || (n == 0) || (n > UPDATER_START) || (n & 1))
+    {
+        return FALSE;
+    }
 
-    tcrc = 0;
-    for (i=0; i<15; i++)    // for all 15 data bytes in CSD...
+    BootOpen(&s, UPDATE_BLOCK + 1, shift);
+    for (*length = n; n; n--)
     {
-        Xchg(csd[i]);           // send each byte via SPI
-        tcrc = AddByteToCRC(tcrc, csd[i]);  // add byte to CRC
+        crc = _crc_ccitt_update(crc, BootByte(&s));
     }
-    Xchg((tcrc<<1) + 1);        // format the CRC7 value and send it
+    BootClose(&s);
+    return !s.failed && (crc == check);
+}
+
 
-    Xchg(0xff);         // ignore dummy checksum
-    Xchg(0xff);         // ignore dummy checksum
 
-    i = 0xffff;         // max timeout
-    while (!Xchg(0xff) && (--i));   // wait until we are not busy
+/*
+ * BootFlash(length)
+ * Writes the image to flash, page 0 last, and verifies it. Returns TRUE
+ * once the whole image is in.
+ */
+static uint8_t BootFlash(uint16_t length)
+{
+    BootStream  s;
+    uint8_t     shift;
+    uint16_t    addr;
 
-    if (i)
+    shift = BootInit();
+    if (shift == UPDATE_NO_CARD)
     {
-        return SDCARD_OK;       // return success
+        return FALSE;
     }
-    else
+    eeprom_busy_wait();     // no SPM while the EEPROM is being written
+
+    BootOpen(&s, UPDATE_BLOCK + 1, shift);
+    for (addr=0; addr<length; addr+=SPM_PAGESIZE)
+    {
+        LEDSW_PORT ^= LEDSW_MASK;   // blink while flashing
+        if (!BootWritePage(&s, addr, (addr == 0)))  // page 0 points the reset vector here for now
+        {
+            BootClose(&s);
+            return FALSE;
+        }
+    }
+    BootClose(&s);
+    if (!BootVerify(length, shift, 2))
     {
-        return SDCARD_TIMEOUT;  // nope, didn't work
+        return FALSE;
     }
+
+    BootOpen(&s, UPDATE_BLOCK + 1, shift);
+    BootWritePage(&s, 0, FALSE);    // now the real one
+    BootClose(&s);
+    return BootVerify(length, shift, 0);
 }
 
 
 
-static void GenerateCRCTable(void)
+/*
+ * BootWritePage(s, addr, patch)
+ * Fills the page buffer from the stream and writes it to the flash page at
+ * addr. If patch is set, the first word is a jump to the updater instead.
+ * Leaves the flash alone and returns FALSE if the stream failed.
+ */
+static uint8_t BootWritePage(BootStream *s, uint16_t addr, uint8_t patch)
 {
-    uint16_t i, j;
+    uint8_t     i;
+    uint16_t    w;
 
-    // generate a table value for all 256 possible byte values
-    for (i=0; i<256; i++)
+    for (i=0; i<SPM_PAGESIZE; i+=2)
     {
-        crctable[i] = (i & 0x80) ? i ^ CRC7_POLY : i;
-        for (j=1; j<8; j++)
+        w = BootByte(s);
+        w |= BootByte(s) << 8;
+        if (patch && (i == 0))
         {
-            crctable[i] <<= 1;
-            if (crctable[i] & 0x80)
-            {
-                crctable[i] ^= CRC7_POLY;
-            }
+            w = RJMP(0, UPDATER_RESUME);
         }
+        boot_page_fill(addr + i, w);
+    }
+    if (s->failed)
+    {
+        SPMCSR = (1<<CTPB); // drop the partly filled page buffer
+        return FALSE;
     }
+    boot_page_erase(addr);  // does not touch the page buffer
+    boot_spm_busy_wait();
+    boot_page_write(addr);
+    boot_spm_busy_wait();
+    return TRUE;
 }
 
 
 
-static uint8_t AddByteToCRC(uint8_t crc, uint8_t b)
+/*
+ * BootVerify(length, shift, first)
+ * Compares the flash with the image on the card, from byte first on.
+ * Returns TRUE if they match.
+ */
+static uint8_t BootVerify(uint16_t length, uint8_t shift, uint16_t first)
 {
-    return crctable[(crc << 1) ^ b];
-}
+    BootStream  s;
+    uint16_t    addr;
+    uint8_t     match = TRUE;
 
+    BootOpen(&s, UPDATE_BLOCK + 1, shift);
+    for (addr=0; addr<length; addr++)
+    {
+        if ((BootByte(&s) != pgm_read_byte((const uint8_t *)(uintptr_t)addr)) && (addr >= first))
+        {
+            match = FALSE;
+        }
+    }
+    BootClose(&s);
+    return match && !s.failed;
+}
 
 
 
 /*
- * SD_send_command(command, arg)
- * Sends a raw command to SD card, returns the response.
- *
- * This routine accepts a single SD command and a 4-byte argument. It sends
- * the command plus argument, adding the appropriate CRC. It then returns
- * the one-byte response from the SD card.
- *
- * For advanced commands (those with a command byte having bit 7 set), this
- * routine automatically sends the required preface command (CMD55) before
- * sending the requested command.
- *
- * Upon exit, this routine returns the response byte from the SD card.
- * Possible responses are:
- *   0xff   No response from card; card might actually be missing
- *   0x01   SD card returned 0x01, which is OK for most commands
- *   0x??   other responses are command-specific
+ * BootInit()
+ * Sets up the lines and initializes the card, like SDInit() but standing
+ * alone. Returns the shift from block number to card address, or
+ * UPDATE_NO_CARD.
  */
-static uint8_t SD_send_command(uint8_t command, uint32_t arg)
+static uint8_t BootInit(void)
 {
-    uint8_t response;
-    uint8_t i;
-    uint8_t crc;
+    uint16_t    i;
+    uint8_t     r;
+    uint32_t    hcs = 0;
 
-    if (command & 0x80)     // special case, ACMD(n) is sent as CMD55 and CMDn
+    SPI_PORT |= (1<<CS_BIT) | (1<<MOSI_BIT) | (1<<MISO_BIT);
+    SPI_PORT &= ~(1<<SCK_BIT);
+    SPI_DDR  |= (1<<CS_BIT) | (1<<MOSI_BIT) | (1<<SCK_BIT);
+    SPI_DDR  &= ~(1<<MISO_BIT);
+    LEDSW_AS_LED;
+
+    for (i=0; i<10; i++)
     {
-        command = command & 0x7f;               // strip high bit for later
-        response = SD_send_command(CMD55, 0);   // send first part (recursion)
-        if (response > 1)
+        BootXchg(0xff);     // 80 clocks with the card deselected
+    }
+    r = BootCommand(SD_GO_IDLE, 0);
+    BootDeselect();
+    if (r != 0x01)
+    {
+        return UPDATE_NO_CARD;
+    }
+    if (BootCommand(SD_SEND_IF_COND, 0x1aa) == 0x01)
+    {
+        for (i=0; i<4; i++)
         {
-            return response;
+            BootXchg(0xff); // skip the R7 tail
         }
+        hcs = 0x40000000;   // v2 card, may be block addressed
+    }
+    for (i=0; i<UPDATE_POLLS; i++)
+    {
+        BootCommand(CMD55, 0);
+        r = BootCommand(SD_ADV_INIT & 0x7f, hcs);
+        if (r == 0)
+        {
+            break;
+        }
+        _delay_ms(1);
+    }
+    if (r != 0)
+    {
+        BootDeselect();
+        return UPDATE_NO_CARD;
     }
 
-    Deselect();
-    Xchg(0xff);
-    Select();   // enable CS
-    Xchg(0xff);
-
-    Xchg(command | 0x40);       // command always has bit 6 set!
-    Xchg((uint8_t)(arg>>24));   // send data, starting with top byte
-    Xchg((uint8_t)(arg>>16));
-    Xchg((uint8_t)(arg>>8));
-    Xchg((uint8_t)(arg&0xff));
-    crc = 0x01;                 // good for most cases
-
-    if (command == SD_GO_IDLE)
+    r = 9;
+    if (hcs)
     {
-        crc = 0x95;             // this will be good enough for most commands
+        if (BootCommand(SD_READ_OCR, 0) != 0)
+        {
+            BootDeselect();
+            return UPDATE_NO_CARD;
+        }
+        if (BootXchg(0xff) & OCR_CCS_MASK)
+        {
+            r = 0;
+        }
+        for (i=0; i<3; i++)
+        {
+            BootXchg(0xff);
+        }
     }
-    if (command == SD_SEND_IF_COND)
+    if (r)
     {
-        crc = 0x87;             // special case, have to use different CRC
+        BootCommand(SD_SET_BLK_LEN, SD_BLOCK_LEN);
     }
+    BootDeselect();
+    return r;
+}
 
-    Xchg(crc);                  // send final byte
 
-    for (i=0; i<10; i++)        // loop until timeout or response
+
+/*
+ * BootOpen(s, block, shift)
+ * Starts a stream at a card block. Nothing is read until the first byte.
+ */
+static void BootOpen(BootStream *s, uint32_t block, uint8_t shift)
+{
+    s->block = block;
+    s->left = 0;
+    s->shift = shift;
+    s->open = FALSE;
+    s->failed = FALSE;
+}
+
+
+
+/*
+ * BootByte(s)
+ * Returns the next byte of the stream, reading the next block with CMD17
+ * as needed. Returns 0xff and flags the stream on errors.
+ */
+static uint8_t BootByte(BootStream *s)
+{
+    uint16_t    i;
+
+    if (s->failed)
     {
-        response = Xchg(0xff);
-        if ((response & 0x80) == 0)
+        return 0xff;
+    }
+    if (s->left == 0)
+    {
+        BootClose(s);
+        if (BootCommand(SD_READ_BLK, s->block << s->shift) != 0)
         {
-            break;              // high bit cleared means we got a response
+            s->failed = TRUE;
+        }
+        for (i=0; !s->failed && (BootXchg(0xff) != 0xfe); i++)
+        {
+            if (i == UPDATE_TOKEN_WAIT)
+            {
+                s->failed = TRUE;
+            }
+        }
+        if (s->failed)
+        {
+            BootDeselect();
+            return 0xff;
         }
+        s->block++;
+        s->left = SD_BLOCK_LEN;
+        s->open = TRUE;
     }
+    s->left--;
+    return BootXchg(0xff);
+}
 
-    /*
-     * We have issued the command but the SD card is still selected. We
-     * only deselect the card if the command we just sent is NOT a command
-     * that requires additional data exchange, such as reading or writing
-     * a block.
-     */
-    if ((command != SD_READ_BLK) &&
-        (command != SD_READ_OCR) &&
-        (command != SD_SEND_CSD) &&
-        (command != SD_SEND_STATUS) &&
-        (command != SD_SEND_CID) &&
-        (command != SD_SEND_IF_COND) &&
-        (command != SD_LOCK_UNLOCK) &&
-        (command != SD_PROGRAM_CSD))
+
+
+/*
+ * BootClose(s)
+ * Reads out the rest of the current block and its CRC, and deselects the card.
+ */
+static void BootClose(BootStream *s)
+{
+    if (s->open)
     {
-        Deselect(); // all done
-        Xchg(0xff); // close with eight more clocks
+        for (; s->left; s->left--)
+        {
+            BootXchg(0xff);
+        }
+        BootXchg(0xff);     // CRC
+        BootXchg(0xff);
+        s->open = FALSE;
     }
-
-    return response;    // let the caller sort it out
+    BootDeselect();
 }
 
 
-static uint8_t SD_wait_for_data(void)
+
+/*
+ * BootCommand(command, arg)
+ * Sends a command and returns its R1 response, leaving the card selected.
+ * Only CMD0 and CMD8 need a valid CRC, the card ignores it for the rest.
+ */
+static uint8_t BootCommand(uint8_t command, uint32_t arg)
 {
     uint8_t i;
     uint8_t r;
 
-    for (i=0; i<100; i++)
+    BootDeselect();
+    SPI_PORT &= ~(1<<CS_BIT);
+    BootXchg(0xff);
+    BootXchg(command);
+    for (i=0; i<4; i++)
     {
-        r = Xchg(0xff);
-        if (r != 0xff)
+        BootXchg(arg >> 24);
+        arg <<= 8;
+    }
+    BootXchg((command == SD_GO_IDLE) ? 0x95 : (command == SD_SEND_IF_COND) ? 0x87 : 0x01);
+    for (i=0; i<10; i++)
+    {
+        r = BootXchg(0xff);
+        if ((r & 0x80) == 0)
         {
             break;
         }
     }
     return r;
 }
+
+
+
+/*
+ * BootDeselect()
+ * Deselects the card, with eight clocks to let it release MISO.
+ */
+static void BootDeselect(void)
+{
+    SPI_PORT |= (1<<CS_BIT);
+    BootXchg(0xff);
+}
+
+
+
+/*
+ * BootXchg(c)
+ * Exchanges a byte with the card, like Xchg() but at a fixed rate below
+ * the 400 kHz allowed during initialization.
+ */
+static uint8_t BootXchg(uint8_t c)
+{
+    uint8_t bit;
+
+    for (bit=0; bit<8; bit++)
+    {
+        if (c & 0x80) SPI_PORT |= (1<<MOSI_BIT);
+        else SPI_PORT &= ~(1<<MOSI_BIT);
+        _delay_us(1);
+        SPI_PORT |= (1<<SCK_BIT);
+        c <<= 1;
+        if (SPI_PIN & (1<<MISO_BIT)) c |= 0x01;
+        _delay_us(1);
+        SPI_PORT &= ~(1<<SCK_BIT);
+    }
+    return c;
+}
+#endif